@@ -0,0 +1,83 @@
+#include "aot.h"
+
+// Function local so that it is constructed before the first generated module registers itself.
+static std::vector<const AotTranslation*>& aot_translations() {
+  static std::vector<const AotTranslation*> translations;
+  return translations;
+}
+
+bool register_aot_translation(const AotTranslation& translation) {
+  aot_translations().push_back(&translation);
+  return true;
+}
+
+uint32_t rom_checksum(const uint8_t* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void Aot::invalidate_page(CPUState& cpu, uint8_t page) {
+  for (uint16_t start_pc : page_blocks[page]) {
+    if (entries[start_pc]) {
+      entries[start_pc] = nullptr;
+      invalidations++;
+    }
+  }
+  page_blocks[page].clear();
+  cpu.code_pages[page] &= ~CODE_PAGE_AOT;
+  invalidated = true;
+}
+
+bool attach_aot(CPUState& cpu, Aot& aot) {
+  for (const AotTranslation* translation : aot_translations()) {
+    if (translation->rom_size > 0x10000 || rom_checksum(cpu.ram, translation->rom_size) != translation->rom_checksum) {
+      continue;
+    }
+
+    aot.translation = translation;
+    for (size_t i = 0; i < translation->block_count; i++) {
+      const AotBlock& block = translation->blocks[i];
+      aot.entries[block.start_pc] = &block;
+
+      // Register the block with every page it was translated from.
+      uint8_t first_page = block.start_pc >> 8;
+      uint8_t last_page = (uint16_t)(block.end_pc - 1) >> 8;
+      for (uint8_t page = first_page; ; page++) {
+        aot.page_blocks[page].push_back(block.start_pc);
+        cpu.code_pages[page] |= CODE_PAGE_AOT;
+        if (page == last_page) {
+          break;
+        }
+      }
+    }
+
+    cpu.aot = &aot;
+    return true;
+  }
+  return false;
+}
+
+uint32_t run_aot(CPUState& cpu, uint32_t budget) {
+  Aot& aot = *cpu.aot;
+  uint32_t cycles = 0;
+
+  while (cycles < budget && !cpu.halt) {
+    const AotBlock* block = aot.entries[cpu.pc];
+    if (block) {
+      aot.invalidated = false;
+      aot.exit_instructions = 0;
+      aot.executions++;
+      cycles += block->code(cpu);
+      cpu.instructions += aot.exit_instructions ? aot.exit_instructions : block->instructions;
+    } else {
+      // Not reached by the recompiler (or overwritten since), interpret a single instruction.
+      aot.interpreted_instructions++;
+      cycles += cycle_cpu(cpu);
+    }
+  }
+
+  return cycles;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "cpu.h"
+
+// Translated basic block, returns the number of cycles taken with cpu.pc set to the next instruction.
+using AotCode = uint32_t (*)(CPUState&);
+
+struct AotBlock {
+  uint16_t start_pc;
+  uint16_t end_pc; // PC after the last instruction of the block.
+  uint16_t instructions;
+  AotCode code;
+};
+
+// Output of the static recompiler for one ROM image, see recompiler.cpp.
+struct AotTranslation {
+  const char* rom_name;
+  uint32_t rom_size;
+  uint32_t rom_checksum;
+  const AotBlock* blocks;
+  size_t block_count;
+};
+
+// Called by the generated code during static initialization, linking a translation is enough to make it available.
+bool register_aot_translation(const AotTranslation& translation);
+
+// Checksum identifying a ROM image (32-bit FNV-1a).
+uint32_t rom_checksum(const uint8_t* data, size_t size);
+
+// Blocks of the translation matching the loaded ROM, indexed by start address.
+struct Aot {
+  const AotTranslation* translation = nullptr;
+  std::array<const AotBlock*, 0x10000> entries {};
+
+  // Start addresses of the blocks overlapping each 256-byte page.
+  std::array<std::vector<uint16_t>, 256> page_blocks;
+
+  // Set when translated code is overwritten, blocks exit after the instruction that did it and store how many
+  // instructions they retired in exit_instructions (left at 0 by blocks that ran to the end).
+  bool invalidated = false;
+  uint16_t exit_instructions = 0;
+
+  // Statistics
+  uint64_t executions = 0, interpreted_instructions = 0, invalidations = 0;
+
+  void invalidate_page(CPUState& cpu, uint8_t page);
+};
+
+// Attaches the linked translation matching the ROM in memory, returns false if there is none.
+bool attach_aot(CPUState& cpu, Aot& aot);
+
+// Same as run_cycles, but executes the statically translated blocks where they exist.
+uint32_t run_aot(CPUState& cpu, uint32_t budget);
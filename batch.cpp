@@ -0,0 +1,137 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+BatchInstance& BatchRunner::add_instance(uint64_t frames) {
+  instances.push_back(std::make_unique<BatchInstance>());
+  instances.back()->frames = frames;
+  return *instances.back();
+}
+
+// Queue of instance indices, the owner works at the back and thieves take from the front.
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<size_t> instances;
+
+  void push(size_t instance) {
+    std::lock_guard<std::mutex> lock(mutex);
+    instances.push_back(instance);
+  }
+
+  bool pop(size_t& instance) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (instances.empty()) {
+      return false;
+    }
+    instance = instances.back();
+    instances.pop_back();
+    return true;
+  }
+
+  bool steal(size_t& instance) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (instances.empty()) {
+      return false;
+    }
+    instance = instances.front();
+    instances.pop_front();
+    return true;
+  }
+};
+
+static void pin_thread(unsigned cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % CPU_SETSIZE, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+// Runs up to `slice_frames` frames of the instance, returns whether it has frames left.
+static bool run_slice(BatchInstance& instance, int worker, uint32_t slice_frames) {
+  if (instance.last_worker != -1 && instance.last_worker != worker) {
+    instance.migrations++;
+  }
+  instance.last_worker = worker;
+  instance.slices++;
+
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    for (uint32_t i = 0; i < slice_frames && instance.frames_run < instance.frames; i++) {
+      if (instance.before_frame) {
+        instance.before_frame(instance, instance.frames_run);
+      }
+      instance.cycles += run_frame(instance.cpu, instance.scheduler);
+      instance.frames_run++;
+    }
+  } catch (...) {
+    instance.error = std::current_exception();
+  }
+  instance.host_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  return !instance.error && instance.frames_run < instance.frames;
+}
+
+void BatchRunner::run() {
+  unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+  threads = std::max(1u, std::min<unsigned>(threads, instances.size()));
+  const uint32_t slice_frames = std::max(1u, options.slice_frames);
+
+  std::vector<WorkQueue> queues(threads);
+  std::atomic<size_t> remaining = 0;
+  for (size_t i = 0; i < instances.size(); i++) {
+    if (instances[i]->frames_run < instances[i]->frames) {
+      queues[i % threads].instances.push_back(i);
+      remaining++;
+    }
+  }
+  worker_stats.assign(threads, {});
+
+  const auto worker = [&](unsigned id) {
+    if (options.pin_threads) {
+      pin_thread(id);
+    }
+    BatchWorkerStats& stats = worker_stats[id];
+
+    while (remaining.load(std::memory_order_acquire)) {
+      size_t instance;
+      bool found = queues[id].pop(instance);
+      for (unsigned offset = 1; !found && offset < threads; offset++) {
+        found = queues[(id + offset) % threads].steal(instance);
+        stats.steals += found;
+      }
+      if (!found) {
+        // Every remaining instance is being run by another worker.
+        std::this_thread::yield();
+        continue;
+      }
+
+      stats.slices++;
+      if (run_slice(*instances[instance], id, slice_frames)) {
+        queues[id].push(instance);
+      } else {
+        remaining.fetch_sub(1, std::memory_order_release);
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned id = 0; id < threads; id++) {
+    workers.emplace_back(worker, id);
+  }
+  for (std::thread& thread : workers) {
+    thread.join();
+  }
+}
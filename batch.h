@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+#include "guest_memory.h"
+#include "scheduler.h"
+
+// An independent emulator session run by a BatchRunner.
+struct BatchInstance {
+  CPUState cpu;
+  GuestMemory memory; // Backs cpu.ram.
+  Scheduler scheduler;
+
+  // Frames to run, and a hook called before each one (e.g. to feed scripted input).
+  uint64_t frames = 0;
+  std::function<void(BatchInstance& instance, uint64_t frame)> before_frame;
+
+  // Results
+  uint64_t frames_run = 0;
+  uint64_t cycles = 0;
+  double host_seconds = 0;  // Spent running this instance, summed over its slices.
+  uint64_t slices = 0;
+  uint64_t migrations = 0;  // Slices run on another worker than the previous one.
+  int last_worker = -1;
+  std::exception_ptr error; // Set if a frame threw, the instance is then stopped.
+};
+
+struct BatchOptions {
+  // Worker threads, 0 for one per hardware thread.
+  unsigned threads = 0;
+  // Frames an instance runs before going back to its worker's queue.
+  uint32_t slice_frames = 1;
+  // Pins worker i to CPU i (Linux only).
+  bool pin_threads = false;
+};
+
+struct BatchWorkerStats {
+  uint64_t slices = 0, steals = 0;
+};
+
+// Runs many instances to completion on a work-stealing thread pool.
+//
+// Instances are dealt round-robin to the workers' queues. A worker runs the instance at the back of its own queue for
+// one slice and puts it back there if it has frames left, so instances tend to stay on the same core; a worker whose
+// queue is empty steals from the front of another's. Instances share nothing, each slice is a run of run_frame.
+struct BatchRunner {
+  std::vector<std::unique_ptr<BatchInstance>> instances;
+  BatchOptions options;
+  std::vector<BatchWorkerStats> worker_stats;
+
+  explicit BatchRunner(BatchOptions options = {}) : options(options) {}
+
+  BatchInstance& add_instance(uint64_t frames);
+
+  // Blocks until every instance has run its frames (or failed).
+  void run();
+};
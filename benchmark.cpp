@@ -0,0 +1,436 @@
+// Per-opcode microbenchmarks for the interpreter's instruction handlers.
+//
+// Every implemented opcode is executed in isolation through its handler, the way run_cycles dispatches it, from a
+// fixed machine state: the instruction at CODE_ADDRESS with DATA_ADDRESS as its immediate operand, every register
+// pair pointing at data and the stack in RAM, so nothing jumps backward or writes over the code. Conditional
+// branches are measured with their condition holding and not holding, IN and OUT once per port.
+//
+// Each case runs warm-up repetitions that are discarded, then timed repetitions of a fixed number of executions,
+// and reports nanoseconds per execution (min, median, mean, standard deviation, max) as JSON on stdout.
+//
+// Saving and loading a machine state (see save_state.h) is measured the same way, with and without compression,
+// as the "Save state" family.
+//
+// Before anything is timed, the block cache's fused loops are checked to count the instructions they stand for.
+//
+// Usage: benchmark [--iterations=N] [--state-iterations=N] [--repetitions=N] [--warmup=N] [--filter=FAMILY]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "blocks.h"
+#include "cpu.h"
+#include "disassembler.h"
+#include "guest_memory.h"
+#include "save_state.h"
+#include "scheduler.h"
+
+constexpr uint16_t CODE_ADDRESS = 0x2000;
+constexpr uint16_t DATA_ADDRESS = 0x2400;
+constexpr uint16_t STACK_ADDRESS = 0x2300;
+
+struct BenchmarkOptions {
+  uint64_t iterations = 100000;
+  uint64_t state_iterations = 1000;
+  int repetitions = 21;
+  int warmup = 3;
+  std::string filter;
+};
+
+// One opcode measured from one machine state.
+struct BenchmarkCase {
+  std::string family;
+  std::string name;
+  uint8_t opcode;
+  uint8_t port = 0;           // IN and OUT only.
+  bool condition = false;     // Conditional branches only, whether the condition holds.
+  bool conditional = false;
+};
+
+struct Summary {
+  double min, median, mean, stddev, max;
+};
+
+// Groups opcodes by the shape of their handler.
+std::string opcode_family(uint8_t opcode) {
+  const uint8_t ddd = (opcode >> 3) & 0b111;
+  const uint8_t sss = opcode & 0b111;
+
+  if (opcode == 0x76) return "HLT";
+  if ((opcode & 0b11000000) == 0x40) {
+    if (ddd == 0b110) return "MOV M,r";
+    if (sss == 0b110) return "MOV r,M";
+    return "MOV r,r";
+  }
+  if ((opcode & 0b11000000) == 0x80) return sss == 0b110 ? "ALU M" : "ALU r";
+  if ((opcode & 0b11000111) == 0xC6) return "ALU immediate";
+  if ((opcode & 0b11000111) == 0x06) return "MVI";
+  if ((opcode & 0b11000110) == 0x04) return "INR/DCR";
+  if ((opcode & 0b11000111) == 0xC2) return "Jcc";
+  if ((opcode & 0b11000111) == 0xC4) return "Ccc";
+  if ((opcode & 0b11000111) == 0xC0) return "Rcc";
+  if ((opcode & 0b11000111) == 0xC7) return "RST";
+
+  switch (opcode & 0b11001111) {
+    case 0x01: return "LXI";
+    case 0x03: case 0x0B: return "INX/DCX";
+    case 0x09: return "DAD";
+    case 0xC5: return "PUSH";
+    case 0xC1: return "POP";
+  }
+
+  switch (opcode) {
+    case 0x3A: case 0x32: case 0x2A: case 0x22: case 0x0A: case 0x1A: case 0x02: case 0x12: return "Load/store";
+    case 0xC3: case 0xCD: case 0xC9: case 0xE9: return "JMP/CALL/RET";
+    case 0xE3: return "XTHL";
+    case 0xDB: return "IN";
+    case 0xD3: return "OUT";
+  }
+
+  return "Other";
+}
+
+constexpr bool is_conditional(uint8_t opcode) {
+  return (opcode & 0b11000111) == 0xC2 || (opcode & 0b11000111) == 0xC4 || (opcode & 0b11000111) == 0xC0;
+}
+
+std::vector<BenchmarkCase> make_cases() {
+  std::vector<BenchmarkCase> cases;
+  for (int opcode = 0; opcode < 256; opcode++) {
+    if (!is_implemented(opcode)) {
+      continue;
+    }
+
+    BenchmarkCase base { opcode_family(opcode), opcode_mnemonic(opcode), (uint8_t)opcode };
+    if (is_conditional(opcode)) {
+      for (bool condition : { true, false }) {
+        BenchmarkCase branch = base;
+        branch.name += condition ? " (taken)" : " (not taken)";
+        branch.condition = condition;
+        branch.conditional = true;
+        cases.push_back(branch);
+      }
+    } else if (opcode == 0xDB) {
+      for (uint8_t port : { 0, 1, 2, 3 }) {
+        BenchmarkCase in = base;
+        in.name += " " + std::to_string(port);
+        in.port = port;
+        cases.push_back(in);
+      }
+    } else if (opcode == 0xD3) {
+      for (uint8_t port : { 2, 3, 4, 5, 6 }) {
+        BenchmarkCase out = base;
+        out.name += " " + std::to_string(port);
+        out.port = port;
+        cases.push_back(out);
+      }
+    } else {
+      cases.push_back(base);
+    }
+  }
+  return cases;
+}
+
+// Puts the machine in the state the case starts from, before every repetition.
+void setup(CPUState& cpu, const BenchmarkCase& benchmark) {
+  memset(cpu.ram, 0, 0x10000);
+  cpu.ram[CODE_ADDRESS] = benchmark.opcode;
+  cpu.ram[CODE_ADDRESS + 1] = benchmark.port ? benchmark.port : DATA_ADDRESS & 0xFF;
+  cpu.ram[CODE_ADDRESS + 2] = DATA_ADDRESS >> 8;
+
+  // Returns come back to the data too.
+  cpu.ram[STACK_ADDRESS] = DATA_ADDRESS & 0xFF;
+  cpu.ram[STACK_ADDRESS + 1] = DATA_ADDRESS >> 8;
+
+  cpu.set_register_pair_value(BC_REGISTER, DATA_ADDRESS + 0x100);
+  cpu.set_register_pair_value(DE_REGISTER, DATA_ADDRESS + 0x200);
+  cpu.set_register_pair_value(HL_REGISTER, DATA_ADDRESS);
+  cpu.a() = 0x5A;
+  cpu.input_ports[1] = 0x08;
+
+  // Conditions hold when the flag selected by bits 4-5 of the opcode equals bit 3.
+  const uint8_t condition = (benchmark.opcode >> 3) & 0b111;
+  const bool flag = benchmark.conditional ? benchmark.condition == (bool)(condition & 1) : false;
+  cpu.zero = cpu.carry = cpu.parity = cpu.sign = flag;
+  cpu.aux_carry = false;
+  cpu.pending_flags = 0;
+  cpu.halt = false;
+  cpu.spin_signature = {};
+}
+
+// Nanoseconds per execution of the case's handler over `iterations` executions.
+double run_repetition(CPUState& cpu, const BenchmarkCase& benchmark, Instruction handler, uint64_t iterations) {
+  setup(cpu, benchmark);
+  uint64_t cycles = 0;
+
+  // Hides the handler from the optimizer, it is called indirectly like in run_cycles.
+  asm volatile("" : "+r"(handler));
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    cpu.pc = CODE_ADDRESS;
+    cpu.sp = STACK_ADDRESS;
+    cycles += handler(cpu);
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  // Keeps the loop from being optimized away.
+  asm volatile("" : : "r"(cycles));
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+// Runs `MVI B,n / LXI H / MVI A / JMP loop / loop: MOV M,A / INX H / DCR B / JNZ loop / HLT` through the block
+// cache, which fuses the fill loop, and checks it counts 4 instructions per iteration like the interpreter, whether
+// the iterations run in bulk (n > 1) or the loop falls through after its first pass (n = 1).
+bool check_fused_instruction_counts() {
+  for (uint8_t iterations : { 1, 2, 5 }) {
+    CPUState cpu;
+    GuestMemory memory;
+    cpu.ram = memory.data();
+    const uint8_t loop_address = (CODE_ADDRESS & 0xFF) + 10;
+    const uint8_t program[] = {
+      0x06, iterations,                                        // MVI B,n
+      0x21, DATA_ADDRESS & 0xFF, DATA_ADDRESS >> 8,            // LXI H,DATA_ADDRESS
+      0x3E, 0x5A,                                              // MVI A,5Ah
+      0xC3, loop_address, CODE_ADDRESS >> 8,                   // JMP loop
+      0x77, 0x23, 0x05, 0xC2, loop_address, CODE_ADDRESS >> 8, // loop: MOV M,A / INX H / DCR B / JNZ loop
+      0x76,                                                    // HLT
+    };
+    memcpy(cpu.ram + CODE_ADDRESS, program, sizeof(program));
+    cpu.pc = CODE_ADDRESS;
+
+    BlockCache cache;
+    attach_block_cache(cpu, cache);
+    while (!cpu.halt) {
+      run_blocks(cpu, 1000);
+    }
+
+    const uint64_t expected = 5 + 4 * iterations;
+    if (cpu.instructions != expected || cache.fused_executions[FUSED_FILL_LOOP] == 0) {
+      std::cerr << "Error: Fused fill loop of " << (int)iterations << " iterations counted " << cpu.instructions
+        << " instructions, expected " << expected << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Memory shaped like the game's: a work area of varied bytes, mostly blank video memory and nothing above it.
+void fill_game_memory(CPUState& cpu) {
+  std::mt19937 random(0);
+  memset(cpu.ram, 0, 0x10000);
+  for (size_t addr = 0; addr < 0x2400; addr++) {
+    cpu.ram[addr] = random();
+  }
+  for (size_t addr = 0x2400; addr < 0x4000; addr++) {
+    cpu.ram[addr] = random() % 8 ? 0 : random();
+  }
+}
+
+// Nanoseconds per save_state (appending to a cleared `state`), or per load_state of `state`.
+double run_state_repetition(CPUState& cpu, Scheduler& scheduler, bool load, bool compress,
+  std::vector<uint8_t>& state, uint64_t iterations) {
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    if (load) {
+      load_state(cpu, scheduler, state.data(), state.size());
+    } else {
+      state.clear();
+      save_state(cpu, scheduler, compress, state);
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+Summary summarize(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  Summary summary {};
+  summary.min = samples.front();
+  summary.max = samples.back();
+  const size_t middle = samples.size() / 2;
+  summary.median = samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+  for (double sample : samples) {
+    summary.mean += sample;
+  }
+  summary.mean /= samples.size();
+  for (double sample : samples) {
+    summary.stddev += (sample - summary.mean) * (sample - summary.mean);
+  }
+  summary.stddev = std::sqrt(summary.stddev / samples.size());
+  return summary;
+}
+
+Summary measure(CPUState& cpu, const BenchmarkCase& benchmark, Instruction handler, const BenchmarkOptions& options) {
+  for (int i = 0; i < options.warmup; i++) {
+    run_repetition(cpu, benchmark, handler, options.iterations);
+  }
+
+  std::vector<double> samples;
+  for (int i = 0; i < options.repetitions; i++) {
+    samples.push_back(run_repetition(cpu, benchmark, handler, options.iterations));
+  }
+  return summarize(samples);
+}
+
+std::string json_string(const std::string& value) {
+  std::string escaped = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped + "\"";
+}
+
+void print_summary(const Summary& summary) {
+  std::cout << "{\"min\": " << summary.min << ", \"median\": " << summary.median << ", \"mean\": " << summary.mean
+    << ", \"stddev\": " << summary.stddev << ", \"max\": " << summary.max << "}";
+}
+
+// Times saving and loading states of game-like memory, with and without compression, and prints them as a JSON
+// array: state size, nanoseconds per operation and megabytes of guest memory per second at the median.
+void print_save_state_results(CPUState& cpu, const BenchmarkOptions& options) {
+  fill_game_memory(cpu);
+  Scheduler scheduler;
+  std::vector<uint8_t> state;
+
+  std::cout << "[";
+  bool first = true;
+  for (bool compress : { false, true }) {
+    for (bool load : { false, true }) {
+      std::vector<double> samples;
+      for (int i = 0; i < options.warmup + options.repetitions; i++) {
+        const double ns = run_state_repetition(cpu, scheduler, load, compress, state, options.state_iterations);
+        if (i >= options.warmup) {
+          samples.push_back(ns);
+        }
+      }
+
+      const Summary summary = summarize(samples);
+      std::cout << (first ? "\n  " : ",\n  ")
+        << "{\"family\": \"Save state\""
+        << ", \"name\": \"" << (load ? "load" : "save") << (compress ? " compressed" : "") << "\""
+        << ", \"bytes\": " << state.size()
+        << ", \"ns\": ";
+      print_summary(summary);
+      std::cout << ", \"mb_per_second\": " << STATE_RAM_SIZE / summary.median * 1e3 << "}";
+      first = false;
+    }
+  }
+  std::cout << "\n ]";
+}
+
+BenchmarkOptions parse_options(int argc, char* argv[]) {
+  BenchmarkOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value = arg.substr(arg.find('=') + 1);
+    if (arg.rfind("--iterations=", 0) == 0) {
+      options.iterations = std::max(1ull, std::stoull(value));
+    } else if (arg.rfind("--state-iterations=", 0) == 0) {
+      options.state_iterations = std::max(1ull, std::stoull(value));
+    } else if (arg.rfind("--repetitions=", 0) == 0) {
+      options.repetitions = std::max(1, std::stoi(value));
+    } else if (arg.rfind("--warmup=", 0) == 0) {
+      options.warmup = std::stoi(value);
+    } else if (arg.rfind("--filter=", 0) == 0) {
+      options.filter = value;
+    } else {
+      throw std::runtime_error("Error: Unknown option " + arg);
+    }
+  }
+  return options;
+}
+
+int main(int argc, char* argv[]) {
+  BenchmarkOptions options = parse_options(argc, argv);
+  if (!check_fused_instruction_counts()) {
+    return 1;
+  }
+
+  CPUState cpu;
+  init_cpu_state(cpu);
+  GuestMemory memory;
+  cpu.ram = memory.data();
+
+  // Cost of the loop around the handler, measured on a handler doing nothing.
+  const BenchmarkCase empty { "Harness", "empty handler", 0x00 };
+  const Summary overhead = measure(cpu, empty, [](CPUState&) -> uint32_t { return 0; }, options);
+
+  std::cout << "{\"iterations\": " << options.iterations
+    << ", \"repetitions\": " << options.repetitions
+    << ", \"state_iterations\": " << options.state_iterations
+    << ", \"warmup\": " << options.warmup
+#ifdef LAZY_FLAGS
+    << ", \"lazy_flags\": true"
+#else
+    << ", \"lazy_flags\": false"
+#endif
+    << ", \"unit\": \"ns\""
+    << ",\n \"overhead\": ";
+  print_summary(overhead);
+  std::cout << ",\n \"results\": [";
+
+  // Median of each family's cases, in the order families first appear.
+  std::vector<std::pair<std::string, std::vector<double>>> families;
+
+  bool first = true;
+  for (const BenchmarkCase& benchmark : make_cases()) {
+    if (!options.filter.empty() && benchmark.family != options.filter) {
+      continue;
+    }
+
+    const Summary summary = measure(cpu, benchmark, get_instruction(benchmark.opcode), options);
+
+    auto family = std::find_if(families.begin(), families.end(),
+      [&](const auto& entry) { return entry.first == benchmark.family; });
+    if (family == families.end()) {
+      family = families.insert(families.end(), { benchmark.family, {} });
+    }
+    family->second.push_back(summary.median);
+
+    char opcode[8];
+    snprintf(opcode, sizeof(opcode), "0x%02X", benchmark.opcode);
+    std::cout << (first ? "\n  " : ",\n  ")
+      << "{\"family\": " << json_string(benchmark.family)
+      << ", \"name\": " << json_string(benchmark.name)
+      << ", \"opcode\": \"" << opcode << "\""
+      << ", \"cycles\": " << (int)(benchmark.conditional && benchmark.condition
+        ? get_taken_instruction_cycles(benchmark.opcode)
+        : get_instruction_cycles(benchmark.opcode))
+      << ", \"ns\": ";
+    print_summary(summary);
+    std::cout << "}";
+    first = false;
+  }
+
+  std::cout << "\n ],\n \"families\": [";
+  first = true;
+  for (const auto& [family, medians] : families) {
+    std::cout << (first ? "\n  " : ",\n  ")
+      << "{\"family\": " << json_string(family)
+      << ", \"cases\": " << medians.size()
+      << ", \"ns\": ";
+    print_summary(summarize(medians));
+    std::cout << "}";
+    first = false;
+  }
+  std::cout << "\n ]";
+
+  if (options.filter.empty() || options.filter == "Save state") {
+    std::cout << ",\n \"save_state\": ";
+    print_save_state_results(cpu, options);
+  }
+  std::cout << "\n}" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include "blocks.h"
+
+// Opcodes of the loops run by fused handlers, ending with a JNZ back to the first instruction.
+struct FusionPattern {
+  FusedPattern pattern;
+  std::vector<uint8_t> opcodes;
+};
+
+static const FusionPattern fusion_patterns[] = {
+  { FUSED_COPY_LOOP, { 0x1A, 0x77, 0x23, 0x13, 0x05, 0xC2 } },
+  { FUSED_FILL_LOOP, { 0x77, 0x23, 0x05, 0xC2 } },
+};
+
+// Replaces the block's instructions with a fused handler if the block is one of the known loops.
+static void fuse_block(Block& block) {
+  for (const FusionPattern& fusion : fusion_patterns) {
+    if (block.ops.size() != fusion.opcodes.size() || block.ops.back().operand != block.start_pc) {
+      continue;
+    }
+
+    bool matches = true;
+    for (size_t i = 0; i < block.ops.size(); i++) {
+      matches &= block.ops[i].opcode == fusion.opcodes[i];
+    }
+    if (matches) {
+      MicroOp fused { get_fused_instruction(fusion.pattern), block.start_pc, 0, block.ops[0].opcode,
+        (uint8_t)(block.end_pc - block.start_pc), 0 };
+      block.ops = { fused };
+      return;
+    }
+  }
+}
+
+Block* BlockCache::compile(CPUState& cpu, uint16_t pc) {
+  auto block = std::make_unique<Block>();
+  block->start_pc = pc;
+
+  // Decode until the first branch.
+  while (block->ops.size() < MAX_BLOCK_LENGTH) {
+    uint8_t opcode = cpu.ram[pc];
+    uint8_t length = get_instruction_length(opcode);
+
+    MicroOp op { get_predecoded_instruction(opcode), pc, 0, opcode, length, get_instruction_cycles(opcode) };
+    if (length == 2) {
+      op.operand = cpu.ram[(uint16_t)(pc + 1)];
+    } else if (length == 3) {
+      op.operand = cpu.ram[(uint16_t)(pc + 1)] | (cpu.ram[(uint16_t)(pc + 2)] << 8);
+    }
+    block->ops.push_back(op);
+    pc += length;
+
+    if (is_branch(opcode)) {
+      break;
+    }
+  }
+  block->end_pc = pc;
+  fuse_block(*block);
+
+  // Register the block with every page it was decoded from.
+  uint8_t first_page = block->start_pc >> 8;
+  uint8_t last_page = (uint16_t)(block->end_pc - 1) >> 8;
+  for (uint8_t page = first_page; ; page++) {
+    page_blocks[page].push_back(block->start_pc);
+    cpu.code_pages[page] |= CODE_PAGE_BLOCKS;
+    if (page == last_page) {
+      break;
+    }
+  }
+
+  Block* compiled = block.get();
+  blocks[compiled->start_pc] = std::move(block);
+  return compiled;
+}
+
+void BlockCache::invalidate_page(CPUState& cpu, uint8_t page) {
+  for (uint16_t start_pc : page_blocks[page]) {
+    if (blocks[start_pc]) {
+      retired.push_back(std::move(blocks[start_pc]));
+      invalidations++;
+    }
+  }
+  page_blocks[page].clear();
+  cpu.code_pages[page] &= ~CODE_PAGE_BLOCKS;
+  invalidated = true;
+}
+
+void BlockCache::clear(CPUState& cpu) {
+  for (int page = 0; page < 256; page++) {
+    invalidate_page(cpu, page);
+  }
+}
+
+void attach_block_cache(CPUState& cpu, BlockCache& cache) {
+  cpu.block_cache = &cache;
+}
+
+uint32_t run_block(CPUState& cpu, Block& block) {
+  BlockCache& cache = *cpu.block_cache;
+  cache.retired.clear();
+  cache.invalidated = false;
+
+  // Only the last instruction can branch (or be a fused loop), the cycles of the others are known in advance.
+  uint32_t cycles = 0;
+  const size_t last = block.ops.size() - 1;
+  for (size_t i = 0; i < last; i++) {
+    const MicroOp& op = block.ops[i];
+    op.handler(cpu, op.operand);
+    cycles += op.cycles;
+
+    // The block overwrote itself (or other cached code), continue from a fresh lookup.
+    if (cache.invalidated) [[unlikely]] {
+      cpu.instructions += i + 1;
+      return cycles;
+    }
+  }
+
+  const MicroOp& op = block.ops[last];
+  cycles += op.handler(cpu, op.operand);
+  cpu.instructions += last + 1;
+  return cycles;
+}
+
+uint32_t run_blocks(CPUState& cpu, uint32_t budget) {
+  BlockCache& cache = *cpu.block_cache;
+  uint32_t cycles = 0;
+
+  while (cycles < budget && !cpu.halt) {
+    Block* block = cache.blocks[cpu.pc].get();
+    if (block) {
+      cache.hits++;
+    } else {
+      cache.misses++;
+      block = cache.compile(cpu, cpu.pc);
+    }
+
+    cycles += run_block(cpu, *block);
+  }
+
+  return cycles;
+}
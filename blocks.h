@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+// Longest run of instructions decoded into a single block.
+constexpr auto MAX_BLOCK_LENGTH = 64;
+
+// An instruction decoded ahead of time, its handler is given the operand instead of reading it from memory.
+struct MicroOp {
+  PredecodedInstruction handler;
+  uint16_t pc;
+  uint16_t operand; // Immediate data, 0 for instructions without any.
+  uint8_t opcode;
+  uint8_t length;
+  uint8_t cycles; // Cycles when not taking a branch, what every instruction but the last takes.
+};
+
+// Straight-line run of instructions, only the last one can branch.
+struct Block {
+  uint16_t start_pc;
+  uint16_t end_pc; // PC after falling through the last instruction.
+  std::vector<MicroOp> ops;
+};
+
+struct BlockCache {
+  // Blocks keyed by start address.
+  std::array<std::unique_ptr<Block>, 0x10000> blocks;
+
+  // Start addresses of the blocks overlapping each 256-byte page.
+  std::array<std::vector<uint16_t>, 256> page_blocks;
+
+  // Invalidated blocks, kept alive until the block that caused it has finished executing.
+  std::vector<std::unique_ptr<Block>> retired;
+  bool invalidated = false;
+
+  // Statistics
+  uint64_t hits = 0, misses = 0, invalidations = 0;
+
+  // Executions of each fused pattern, and loop iterations they collapsed into bulk memory operations.
+  std::array<uint64_t, FUSED_PATTERN_COUNT> fused_executions {};
+  std::array<uint64_t, FUSED_PATTERN_COUNT> fused_iterations {};
+
+  Block* compile(CPUState& cpu, uint16_t pc);
+  void invalidate_page(CPUState& cpu, uint8_t page);
+  void clear(CPUState& cpu);
+};
+
+// Attaches a block cache to the CPU, writes to cached code then invalidate it.
+void attach_block_cache(CPUState& cpu, BlockCache& cache);
+
+// Executes a single block of the attached block cache, stopping early if it invalidates cached code.
+uint32_t run_block(CPUState& cpu, Block& block);
+
+// Same as run_cycles, but executes predecoded blocks from the attached block cache.
+uint32_t run_blocks(CPUState& cpu, uint32_t budget);
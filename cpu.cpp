@@ -1,5 +1,15 @@
 #include "cpu.h"
+#include "blocks.h"
+#include "jit.h"
+#include "aot.h"
+#include "profiler.h"
+#include "latency.h"
+#include <array>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
 #include <string>
+#include <utility>
 
 // ========================================
 // Miscellaneous Group
@@ -7,120 +17,189 @@
 
 uint32_t nop(CPUState& cpu) {
   cpu.pc++;
-  return 1;
+  return 4;
+}
+
+// ========================================
+// Flags
+// ========================================
+
+// Groups of flags that can be derived from a recorded result.
+constexpr uint8_t FLAG_ZSP = 1 << 0;
+constexpr uint8_t FLAG_AUX_CARRY = 1 << 1;
+constexpr uint8_t FLAG_CARRY = 1 << 2;
+constexpr uint8_t FLAG_ALL = FLAG_ZSP | FLAG_AUX_CARRY | FLAG_CARRY;
+
+// Bits of a zsp_table entry.
+constexpr uint8_t ZSP_ZERO = 1 << 0;
+constexpr uint8_t ZSP_SIGN = 1 << 1;
+constexpr uint8_t ZSP_PARITY = 1 << 2;
+
+// Zero, sign and parity for every 8-bit result.
+constexpr auto zsp_table = [] {
+  std::array<uint8_t, 256> table {};
+  for (int value = 0; value < 256; value++) {
+    table[value] = (value == 0 ? ZSP_ZERO : 0)
+      | (value & 0x80 ? ZSP_SIGN : 0)
+      | (std::popcount((unsigned)value) & 1 ? ZSP_PARITY : 0);
+  }
+  return table;
+}();
+
+// Auxiliary carry for every 8-bit result.
+constexpr auto aux_carry_table = [] {
+  std::array<bool, 256> table {};
+  for (int value = 0; value < 256; value++) {
+    table[value] = (value & 0b11111) > 0b1111;
+  }
+  return table;
+}();
+
+void evaluate_flags(uint16_t result, uint8_t flags, CPUState& cpu) {
+  if (flags & FLAG_ZSP) {
+    uint8_t zsp = zsp_table[result & 0xFF];
+    cpu.zero = zsp & ZSP_ZERO;
+    cpu.sign = zsp & ZSP_SIGN;
+    cpu.parity = zsp & ZSP_PARITY;
+  }
+  if (flags & FLAG_AUX_CARRY) {
+    cpu.aux_carry = aux_carry_table[result & 0xFF];
+  }
+  if (flags & FLAG_CARRY) {
+    cpu.carry = result > 0xFF;
+  }
+}
+
+void materialize_flags([[maybe_unused]] CPUState& cpu) {
+#ifdef LAZY_FLAGS
+  if (cpu.pending_flags) {
+    evaluate_flags(cpu.flag_result, cpu.pending_flags, cpu);
+    cpu.pending_flags = 0;
+  }
+#endif
+}
+
+// Sets `flags` from an ALU result. With LAZY_FLAGS the result is only recorded and the flags are
+// evaluated the next time something reads them (see materialize_flags).
+void set_flags(uint16_t result, uint8_t flags, CPUState& cpu) {
+#ifdef LAZY_FLAGS
+  // Flags still pending from the previous result that this one doesn't replace.
+  if (cpu.pending_flags & ~flags) {
+    materialize_flags(cpu);
+  }
+  cpu.flag_result = result;
+  cpu.pending_flags = flags;
+#else
+  evaluate_flags(result, flags, cpu);
+#endif
 }
 
 // ========================================
 // Data Transfer Group
 // ========================================
 
-uint32_t move_immediate(uint8_t dst_reg, CPUState& cpu) {
-  *cpu.registers[dst_reg] = cpu.get_immediate_value8();
+template <uint8_t dst_reg>
+uint32_t move_immediate(CPUState& cpu, uint16_t operand) {
+  cpu.get_register(dst_reg) = operand;
   cpu.pc += 2;
-  return 2;
+  return 7;
 }
 
-uint32_t move_register(uint8_t dst_reg, uint8_t src_reg, CPUState& cpu) {
-  *cpu.registers[dst_reg] = *cpu.registers[src_reg];
+template <uint8_t dst_reg, uint8_t src_reg>
+uint32_t move_register(CPUState& cpu) {
+  cpu.get_register(dst_reg) = cpu.get_register(src_reg);
   cpu.pc++;
-  return 1;
+  return 5;
 }
 
-uint32_t move_from_hl_indirect(uint8_t dst_reg, CPUState& cpu) {
+template <uint8_t dst_reg>
+uint32_t move_from_hl_indirect(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  *cpu.registers[dst_reg] = cpu.ram[addr];
+  cpu.get_register(dst_reg) = cpu.ram[addr];
   cpu.pc += 1;
-  return 2;
+  return 7;
 }
 
-uint32_t move_to_hl_indirect(uint8_t src_reg, CPUState& cpu) {
+template <uint8_t src_reg>
+uint32_t move_to_hl_indirect(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.ram[addr] = *cpu.registers[src_reg];
+  cpu.write_memory(addr, cpu.get_register(src_reg));
   cpu.pc += 1;
-  return 2;
+  return 7;
 }
 
-uint32_t move_to_memory_immediate(CPUState& cpu) {
+uint32_t move_to_memory_immediate(CPUState& cpu, uint16_t operand) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.ram[addr] = cpu.get_immediate_value8();
+  cpu.write_memory(addr, operand);
   cpu.pc += 2;
-  return 3;
+  return 10;
 }
 
-uint32_t load_register_pair_immediate(uint8_t dst_reg_pair, CPUState& cpu) {
-  uint8_t low_byte = cpu.ram[cpu.pc + 1];
-  uint8_t high_byte = cpu.ram[cpu.pc + 2];
-
-  *cpu.register_pair_low[dst_reg_pair] = low_byte;
-  *cpu.register_pair_high[dst_reg_pair] = high_byte;
+template <uint8_t dst_reg_pair>
+uint32_t load_register_pair_immediate(CPUState& cpu, uint16_t operand) {
+  cpu.set_register_pair_value(dst_reg_pair, operand);
 
   cpu.pc += 3;
 
-  return 3;
+  return 10;
 }
 
-uint32_t load_accumulator_direct(CPUState& cpu) {
-  uint16_t addr = cpu.get_immediate_value16();
-  cpu.a = cpu.ram[addr];
+uint32_t load_accumulator_direct(CPUState& cpu, uint16_t addr) {
+  cpu.a() = cpu.ram[addr];
   cpu.pc += 3;
 
-  return 4;
+  return 13;
 }
 
-uint32_t store_accumulator_direct(CPUState& cpu) {
-  uint16_t addr = cpu.get_immediate_value16();
-  cpu.ram[addr] = cpu.a;
+uint32_t store_accumulator_direct(CPUState& cpu, uint16_t addr) {
+  cpu.write_memory(addr, cpu.a());
   cpu.pc += 3;
 
-  return 4;
+  return 13;
 }
 
-uint32_t load_hl_direct(CPUState& cpu) {
-  uint16_t addr = cpu.get_immediate_value16();
-  cpu.l = cpu.ram[addr];
-  cpu.h = cpu.ram[addr + 1];
+uint32_t load_hl_direct(CPUState& cpu, uint16_t addr) {
+  cpu.l() = cpu.ram[addr];
+  cpu.h() = cpu.ram[(uint16_t)(addr + 1)];
   cpu.pc += 3;
 
-  return 5;
+  return 16;
 }
 
-uint32_t store_hl_direct(CPUState& cpu) {
-  uint16_t addr = cpu.get_immediate_value16();
-  cpu.ram[addr] = cpu.l;
-  cpu.ram[addr + 1] = cpu.h;
+uint32_t store_hl_direct(CPUState& cpu, uint16_t addr) {
+  cpu.write_memory(addr, cpu.l());
+  cpu.write_memory(addr + 1, cpu.h());
   cpu.pc += 3;
 
-  return 5;
+  return 16;
 }
 
-uint32_t load_accumulator_indirect(uint8_t src_reg_pair, CPUState& cpu) {
+template <uint8_t src_reg_pair>
+uint32_t load_accumulator_indirect(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(src_reg_pair);
-  cpu.a = cpu.ram[addr];
+  cpu.a() = cpu.ram[addr];
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t store_accumulator_indirect(uint8_t dst_reg_pair, CPUState& cpu) {
+template <uint8_t dst_reg_pair>
+uint32_t store_accumulator_indirect(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(dst_reg_pair);
-  cpu.ram[addr] = cpu.a;
+  cpu.write_memory(addr, cpu.a());
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
 uint32_t exchange_hl_and_de(CPUState& cpu) {
-  uint8_t temp = cpu.h;
-  cpu.h = cpu.d;
-  cpu.d = temp;
-
-  temp = cpu.l;
-  cpu.l = cpu.e;
-  cpu.e = temp;
+  uint16_t temp = cpu.get_register_pair_value(HL_REGISTER);
+  cpu.set_register_pair_value(HL_REGISTER, cpu.get_register_pair_value(DE_REGISTER));
+  cpu.set_register_pair_value(DE_REGISTER, temp);
 
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 // ========================================
@@ -128,12 +207,8 @@ uint32_t exchange_hl_and_de(CPUState& cpu) {
 // ========================================
 
 void resolve_flags_after_add(uint16_t result, CPUState& cpu) {
-  cpu.a = result & 0xFF;
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.carry = result > 0xFF;
-  cpu.aux_carry = (result & 0b11111) > 0b1111;
+  cpu.a() = result & 0xFF;
+  set_flags(result, FLAG_ALL, cpu);
 }
 
 enum CarryOperation {
@@ -144,6 +219,9 @@ enum CarryOperation {
 
 void add_value_to_accum(uint8_t value, CPUState& cpu, CarryOperation carry_op = NO_CARRY) {
   uint8_t carry = 0;
+  if (carry_op != NO_CARRY) {
+    materialize_flags(cpu);
+  }
   switch (carry_op) {
     case WITH_CARRY:
       carry = cpu.carry ? 1 : 0;
@@ -154,15 +232,16 @@ void add_value_to_accum(uint8_t value, CPUState& cpu, CarryOperation carry_op =
     default:
       break;
   }
-  uint16_t result = (uint16_t)cpu.a + (uint16_t)value + (uint16_t)carry;
+  uint16_t result = (uint16_t)cpu.a() + (uint16_t)value + (uint16_t)carry;
   resolve_flags_after_add(result, cpu);
 }
 
-uint32_t add_register(uint8_t add_reg, CPUState& cpu) {
-  add_value_to_accum(*cpu.registers[add_reg], cpu);
+template <uint8_t add_reg>
+uint32_t add_register(CPUState& cpu) {
+  add_value_to_accum(cpu.get_register(add_reg), cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t add_memory(CPUState& cpu) {
@@ -170,22 +249,24 @@ uint32_t add_memory(CPUState& cpu) {
   add_value_to_accum(cpu.ram[addr], cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t add_immediate(CPUState& cpu) {
-  add_value_to_accum(cpu.get_immediate_value8(), cpu);
+uint32_t add_immediate(CPUState& cpu, uint16_t operand) {
+  add_value_to_accum(operand, cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t add_register_with_carry(uint8_t add_reg, CPUState& cpu) {
+template <uint8_t add_reg>
+uint32_t add_register_with_carry(CPUState& cpu) {
+  materialize_flags(cpu);
   uint8_t carry = cpu.carry ? 1 : 0;
-  add_value_to_accum(*cpu.registers[add_reg] + carry, cpu);
+  add_value_to_accum(cpu.get_register(add_reg) + carry, cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t add_memory_with_carry(CPUState& cpu) {
@@ -193,21 +274,22 @@ uint32_t add_memory_with_carry(CPUState& cpu) {
   add_value_to_accum(cpu.ram[addr], cpu, WITH_CARRY);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t add_immediate_with_carry(CPUState& cpu) {
-  add_value_to_accum(cpu.get_immediate_value8(), cpu, WITH_CARRY);
+uint32_t add_immediate_with_carry(CPUState& cpu, uint16_t operand) {
+  add_value_to_accum(operand, cpu, WITH_CARRY);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t subtract_register(uint8_t sub_reg, CPUState& cpu) {
-  add_value_to_accum(-*cpu.registers[sub_reg], cpu);
+template <uint8_t sub_reg>
+uint32_t subtract_register(CPUState& cpu) {
+  add_value_to_accum(-cpu.get_register(sub_reg), cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t subtract_memory(CPUState& cpu) {
@@ -215,21 +297,22 @@ uint32_t subtract_memory(CPUState& cpu) {
   add_value_to_accum(-cpu.ram[addr], cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t subtract_immediate(CPUState& cpu) {
-  add_value_to_accum(-cpu.get_immediate_value8(), cpu);
+uint32_t subtract_immediate(CPUState& cpu, uint16_t operand) {
+  add_value_to_accum(-operand, cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t subtract_register_with_borrow(uint8_t sub_reg, CPUState& cpu) {
-  add_value_to_accum(-*cpu.registers[sub_reg], cpu, WITH_BORROW);
+template <uint8_t sub_reg>
+uint32_t subtract_register_with_borrow(CPUState& cpu) {
+  add_value_to_accum(-cpu.get_register(sub_reg), cpu, WITH_BORROW);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t subtract_memory_with_borrow(CPUState& cpu) {
@@ -237,47 +320,44 @@ uint32_t subtract_memory_with_borrow(CPUState& cpu) {
   add_value_to_accum(-cpu.ram[addr], cpu, WITH_BORROW);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t subtract_immediate_with_borrow(CPUState& cpu) {
-  add_value_to_accum(-cpu.get_immediate_value8(), cpu, WITH_BORROW);
+uint32_t subtract_immediate_with_borrow(CPUState& cpu, uint16_t operand) {
+  add_value_to_accum(-operand, cpu, WITH_BORROW);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t increment_register(uint8_t reg, CPUState& cpu, uint8_t increment = 1) {
+template <uint8_t reg, uint8_t increment = 1>
+uint32_t increment_register(CPUState& cpu) {
   // IMPORTANT: Does not affect the carry flag.
-  (*cpu.registers[reg]) += increment;
-  cpu.zero = *cpu.registers[reg] == 0;
-  cpu.sign = *cpu.registers[reg] & 0x80;
-  cpu.parity = __builtin_parity(*cpu.registers[reg]);
-  cpu.aux_carry = (*cpu.registers[reg] & 0b11111) > 0b1111;
+  (cpu.get_register(reg)) += increment;
+  set_flags(cpu.get_register(reg), FLAG_ZSP | FLAG_AUX_CARRY, cpu);
   cpu.pc++;
 
-  return 1;
+  return 5;
 }
 
 uint32_t increment_memory(CPUState& cpu, uint8_t increment = 1) {
   // IMPORTANT: Does not affect the carry flag.
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.ram[addr] += increment;
-  cpu.zero = cpu.ram[addr] == 0;
-  cpu.sign = cpu.ram[addr] & 0x80;
-  cpu.parity = __builtin_parity(cpu.ram[addr]);
-  cpu.aux_carry = (cpu.ram[addr] & 0b11111) > 0b1111;
+  uint8_t value = cpu.ram[addr] + increment;
+  cpu.write_memory(addr, value);
+  set_flags(value, FLAG_ZSP | FLAG_AUX_CARRY, cpu);
   cpu.pc++;
 
-  return 3;
+  return 10;
 }
 
 uint32_t increment_memory_op(CPUState& cpu) {
   return increment_memory(cpu);
 }
 
-uint32_t decrement_register(uint8_t reg, CPUState& cpu, uint8_t decrement = 1) {
-  return increment_register(reg, cpu, -decrement);
+template <uint8_t reg, uint8_t decrement = 1>
+uint32_t decrement_register(CPUState& cpu) {
+  return increment_register<reg, (uint8_t)-decrement>(cpu);
 }
 
 uint32_t decrement_memory(CPUState& cpu, uint8_t decrement = 1) {
@@ -288,388 +368,446 @@ uint32_t decrement_memory_op(CPUState& cpu) {
   return decrement_memory(cpu);
 }
 
-uint32_t increment_register_pair(uint8_t reg_pair, CPUState& cpu, uint16_t increment = 1) {
+template <uint8_t reg_pair, uint16_t increment = 1>
+uint32_t increment_register_pair(CPUState& cpu) {
   // IMPORTANT: No flags are affected.
   uint16_t value = cpu.get_register_pair_value(reg_pair);
   value += increment;
-  *cpu.register_pair_low[reg_pair] = value & 0xFF;
-  *cpu.register_pair_high[reg_pair] = value >> 8;
+  cpu.set_register_pair_value(reg_pair, value);
   cpu.pc++;
 
-  return 1;
+  return 5;
 }
 
-uint32_t decrement_register_pair(uint8_t reg_pair, CPUState& cpu, uint16_t decrement = 1) {
-  return increment_register_pair(reg_pair, cpu, -decrement);
+template <uint8_t reg_pair, uint16_t decrement = 1>
+uint32_t decrement_register_pair(CPUState& cpu) {
+  return increment_register_pair<reg_pair, (uint16_t)-decrement>(cpu);
 }
 
 uint32_t decimal_adjust_accumulator(CPUState& cpu) {
+  materialize_flags(cpu);
+
   // If the least significant nibble of the accumulator is greater than 9 or the auxiliary carry flag is set,
   // add 6 to the accumulator.
-  if ((cpu.a & 0x0F) > 9 || cpu.aux_carry) {
-    uint16_t result = cpu.a + 6;
+  if ((cpu.a() & 0x0F) > 9 || cpu.aux_carry) {
+    uint16_t result = cpu.a() + 6;
     resolve_flags_after_add(result, cpu);
   }
 
   // If the most significant nibble of the accumulator is greater than 9 or the carry flag is set,
   // add 6 to the most significant nibble.
-  uint16_t high_nibble = cpu.a >> 4;
+  materialize_flags(cpu);
+  uint16_t high_nibble = cpu.a() >> 4;
   if (high_nibble > 9 || cpu.carry) {
     uint16_t result = high_nibble + 6;
-    result = (result << 4) | (cpu.a & 0x0F);
+    result = (result << 4) | (cpu.a() & 0x0F);
     resolve_flags_after_add(result, cpu);
   }
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
-uint32_t add_register_pair_to_hl(uint8_t reg_pair, CPUState& cpu) {
+template <uint8_t reg_pair>
+uint32_t add_register_pair_to_hl(CPUState& cpu) {
   // IMPORTANT: Only the carry flag is affected.
   uint16_t hl = cpu.get_register_pair_value(HL_REGISTER);
   uint16_t reg_pair_value = cpu.get_register_pair_value(reg_pair);
   uint32_t result = hl + reg_pair_value;
-  cpu.h = (result >> 8) & 0xFF;
-  cpu.l = result & 0xFF;
+  materialize_flags(cpu);
+  cpu.h() = (result >> 8) & 0xFF;
+  cpu.l() = result & 0xFF;
   cpu.carry = result > 0xFFFF;
   cpu.pc++;
 
-  return 3;
+  return 10;
 }
 
 // ========================================
 // Logical Group
 // ========================================
 
-uint32_t and_register(uint8_t reg, CPUState& cpu) {
-  cpu.a &= *cpu.registers[reg];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
+void resolve_flags_after_logic(CPUState& cpu) {
+  set_flags(cpu.a(), FLAG_ZSP | FLAG_CARRY, cpu);
   cpu.aux_carry = false;
-  cpu.carry = false;
+}
+
+template <uint8_t reg>
+uint32_t and_register(CPUState& cpu) {
+  cpu.a() &= cpu.get_register(reg);
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t and_memory(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.a &= cpu.ram[addr];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+  cpu.a() &= cpu.ram[addr];
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t and_immediate(CPUState& cpu) {
-  cpu.a &= cpu.get_immediate_value8();
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+uint32_t and_immediate(CPUState& cpu, uint16_t operand) {
+  cpu.a() &= operand;
+  resolve_flags_after_logic(cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t xor_register(uint8_t reg, CPUState& cpu) {
-  cpu.a ^= *cpu.registers[reg];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+template <uint8_t reg>
+uint32_t xor_register(CPUState& cpu) {
+  cpu.a() ^= cpu.get_register(reg);
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t xor_memory(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.a ^= cpu.ram[addr];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+  cpu.a() ^= cpu.ram[addr];
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t xor_immediate(CPUState& cpu) {
-  cpu.a ^= cpu.get_immediate_value8();
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+uint32_t xor_immediate(CPUState& cpu, uint16_t operand) {
+  cpu.a() ^= operand;
+  resolve_flags_after_logic(cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t or_register(uint8_t reg, CPUState& cpu) {
-  cpu.a |= *cpu.registers[reg];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+template <uint8_t reg>
+uint32_t or_register(CPUState& cpu) {
+  cpu.a() |= cpu.get_register(reg);
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t or_memory(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
-  cpu.a |= cpu.ram[addr];
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+  cpu.a() |= cpu.ram[addr];
+  resolve_flags_after_logic(cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t or_immediate(CPUState& cpu) {
-  cpu.a |= cpu.get_immediate_value8();
-  cpu.zero = cpu.a == 0;
-  cpu.sign = cpu.a & 0x80;
-  cpu.parity = __builtin_parity(cpu.a);
-  cpu.aux_carry = false;
-  cpu.carry = false;
+uint32_t or_immediate(CPUState& cpu, uint16_t operand) {
+  cpu.a() |= operand;
+  resolve_flags_after_logic(cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
-uint32_t compare_register(uint8_t reg, CPUState& cpu) {
-  uint16_t value = (uint16_t)*cpu.registers[reg];
-  uint16_t result = cpu.a - value;
-  cpu.zero = result == 0;
-  cpu.sign = result & 0x80;
-  cpu.parity = __builtin_parity(result);
-  cpu.carry = cpu.a < value;
-  cpu.aux_carry = (result & 0b11111) > 0b1111;
+template <uint8_t reg>
+uint32_t compare_register(CPUState& cpu) {
+  uint16_t value = (uint16_t)cpu.get_register(reg);
+  uint16_t result = cpu.a() - value;
+
+  // Borrowing wraps the result above 0xFF, so the carry flag follows the same rule as for addition.
+  set_flags(result, FLAG_ALL, cpu);
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t compare_memory(CPUState& cpu) {
   uint16_t addr = cpu.get_register_pair_value(HL_REGISTER);
   uint16_t value = (uint16_t)cpu.ram[addr];
-  uint16_t result = cpu.a - value;
-  cpu.zero = result == 0;
-  cpu.sign = result & 0x80;
-  cpu.parity = __builtin_parity(result);
-  cpu.carry = cpu.a < value;
-  cpu.aux_carry = (result & 0b11111) > 0b1111;
+  uint16_t result = cpu.a() - value;
+
+  // Borrowing wraps the result above 0xFF, so the carry flag follows the same rule as for addition.
+  set_flags(result, FLAG_ALL, cpu);
   cpu.pc++;
 
-  return 2;
+  return 7;
 }
 
-uint32_t compare_immediate(CPUState& cpu) {
-  uint16_t value = (uint16_t)cpu.get_immediate_value8();
-  uint16_t result = cpu.a - value;
-  cpu.zero = result == 0;
-  cpu.sign = result & 0x80;
-  cpu.parity = __builtin_parity(result);
-  cpu.carry = cpu.a < value;
-  cpu.aux_carry = (result & 0b11111) > 0b1111;
+uint32_t compare_immediate(CPUState& cpu, uint16_t value) {
+  uint16_t result = cpu.a() - value;
+
+  // Borrowing wraps the result above 0xFF, so the carry flag follows the same rule as for addition.
+  set_flags(result, FLAG_ALL, cpu);
   cpu.pc += 2;
 
-  return 2;
+  return 7;
 }
 
 uint32_t rotate_left(CPUState& cpu) {
-  uint8_t msb = (cpu.a & 0x80) >> 7;
-  cpu.a = (cpu.a << 1) | msb;
+  materialize_flags(cpu);
+  uint8_t msb = (cpu.a() & 0x80) >> 7;
+  cpu.a() = (cpu.a() << 1) | msb;
   cpu.carry = msb == 1;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t rotate_right(CPUState& cpu) {
-  uint8_t lsb = cpu.a & 0x01;
-  cpu.a = cpu.a >> 1 | (lsb << 7);
+  materialize_flags(cpu);
+  uint8_t lsb = cpu.a() & 0x01;
+  cpu.a() = cpu.a() >> 1 | (lsb << 7);
   cpu.carry = lsb == 1;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t rotate_left_through_carry(CPUState& cpu) {
-  uint8_t msb = (cpu.a & 0x80) >> 7;
-  cpu.a = (cpu.a << 1) | (cpu.carry ? 1 : 0);
+  materialize_flags(cpu);
+  uint8_t msb = (cpu.a() & 0x80) >> 7;
+  cpu.a() = (cpu.a() << 1) | (cpu.carry ? 1 : 0);
   cpu.carry = msb == 1;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t rotate_right_through_carry(CPUState& cpu) {
-  uint8_t lsb = cpu.a & 0x01;
-  cpu.a = (cpu.a >> 1) | (cpu.carry ? 1 << 7 : 0);
+  materialize_flags(cpu);
+  uint8_t lsb = cpu.a() & 0x01;
+  cpu.a() = (cpu.a() >> 1) | (cpu.carry ? 1 << 7 : 0);
   cpu.carry = lsb == 1;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t complement_accumulator(CPUState& cpu) {
-  cpu.a = ~cpu.a;
+  cpu.a() = ~cpu.a();
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t complement_carry_flag(CPUState& cpu) {
+  materialize_flags(cpu);
   cpu.carry = !cpu.carry;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t set_carry_flag(CPUState& cpu) {
+  materialize_flags(cpu);
   cpu.carry = true;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 // ========================================
 // Branch Group
 // ========================================
 
-uint32_t jump(CPUState& cpu) {
-  cpu.pc = cpu.get_immediate_value16();
-  return 3;
+template <uint8_t condition_flag>
+bool evaluate_condition(CPUState& cpu) {
+  materialize_flags(cpu);
+  if constexpr (condition_flag == NOT_ZERO_FLAG) {
+    return !cpu.zero;
+  } else if constexpr (condition_flag == ZERO_FLAG) {
+    return cpu.zero;
+  } else if constexpr (condition_flag == NO_CARRY_FLAG) {
+    return !cpu.carry;
+  } else if constexpr (condition_flag == CARRY_FLAG) {
+    return cpu.carry;
+  } else if constexpr (condition_flag == PARITY_ODD_FLAG) {
+    return !cpu.parity;
+  } else if constexpr (condition_flag == PARITY_EVEN_FLAG) {
+    return cpu.parity;
+  } else if constexpr (condition_flag == SIGN_POSITIVE_FLAG) {
+    return !cpu.sign;
+  } else {
+    return cpu.sign;
+  }
 }
 
-bool evaluate_condition(uint8_t condition_flag, CPUState& cpu) {
+// Condition encoded in the ccc bits of a conditional jump, call or return.
+bool evaluate_condition(CPUState& cpu, uint8_t condition_flag) {
   switch (condition_flag) {
-    case NOT_ZERO_FLAG:
-      return !cpu.zero;
-    case ZERO_FLAG:
-      return cpu.zero;
-    case NO_CARRY_FLAG:
-      return !cpu.carry;
-    case CARRY_FLAG:
-      return cpu.carry;
-    case PARITY_ODD_FLAG:
-      return !cpu.parity;
-    case PARITY_EVEN_FLAG:
-      return cpu.parity;
-    case SIGN_POSITIVE_FLAG:
-      return !cpu.sign;
-    case SIGN_NEGATIVE_FLAG:
-      return cpu.sign;
-    default:
-      return false;
+    case NOT_ZERO_FLAG: return evaluate_condition<NOT_ZERO_FLAG>(cpu);
+    case ZERO_FLAG: return evaluate_condition<ZERO_FLAG>(cpu);
+    case NO_CARRY_FLAG: return evaluate_condition<NO_CARRY_FLAG>(cpu);
+    case CARRY_FLAG: return evaluate_condition<CARRY_FLAG>(cpu);
+    case PARITY_ODD_FLAG: return evaluate_condition<PARITY_ODD_FLAG>(cpu);
+    case PARITY_EVEN_FLAG: return evaluate_condition<PARITY_EVEN_FLAG>(cpu);
+    case SIGN_POSITIVE_FLAG: return evaluate_condition<SIGN_POSITIVE_FLAG>(cpu);
+    default: return evaluate_condition<SIGN_NEGATIVE_FLAG>(cpu);
+  }
+}
+
+SpinSignature get_spin_signature(const CPUState& cpu, uint16_t branch_pc) {
+  SpinSignature signature;
+  signature.valid = true;
+  signature.branch_pc = branch_pc;
+  signature.sp = cpu.sp;
+  signature.flags = cpu.zero | cpu.sign << 1 | cpu.parity << 2 | cpu.carry << 3 | cpu.aux_carry << 4;
+  signature.pending_flags = cpu.pending_flags;
+  signature.flag_result = cpu.flag_result;
+  memcpy(&signature.registers, cpu.registers, sizeof(signature.registers));
+  return signature;
+}
+
+// The signature's flags as materialize_flags would leave them.
+uint8_t get_signature_flags(const SpinSignature& signature) {
+  uint8_t flags = signature.flags;
+  if (signature.pending_flags & FLAG_ZSP) {
+    // Zero, sign and parity are the low three bits of both.
+    flags = (flags & ~0b111) | zsp_table[signature.flag_result & 0xFF];
+  }
+  if (signature.pending_flags & FLAG_CARRY) {
+    flags = (flags & ~(1 << 3)) | (signature.flag_result > 0xFF) << 3;
+  }
+  if (signature.pending_flags & FLAG_AUX_CARRY) {
+    flags = (flags & ~(1 << 4)) | aux_carry_table[signature.flag_result & 0xFF] << 4;
   }
+  return flags;
 }
 
-uint32_t conditional_jump(uint8_t condition_flag, CPUState& cpu) {
-  if (evaluate_condition(condition_flag, cpu)) {
-    jump(cpu);
+// Whether both signatures describe the same CPU state, the flags are only derived once everything else matches.
+bool same_spin_state(const SpinSignature& a, const SpinSignature& b) {
+  return a.valid && b.valid && a.branch_pc == b.branch_pc && a.sp == b.sp && a.registers == b.registers
+    && get_signature_flags(a) == get_signature_flags(b);
+}
+
+// Called after the jump at `branch_pc` went back to cpu.pc. If the loop in between only reads and one more iteration
+// leaves the CPU exactly as it is now, the loop can only be left through an interrupt changing memory: the CPU then
+// waits for that interrupt like after HLT, instead of spinning.
+void detect_spin_loop(CPUState& cpu, uint16_t branch_pc) {
+  SpinSignature signature = get_spin_signature(cpu, branch_pc);
+
+  // Only loops found in the same state twice in a row are checked, most loops change a counter every iteration.
+  if (!same_spin_state(signature, cpu.spin_signature) || !is_side_effect_free(cpu.ram, cpu.pc, branch_pc)) {
+    cpu.spin_signature = signature;
+    return;
+  }
+
+  // Run one more iteration on a copy, the loop doesn't write memory so the copy can share it.
+  CPUState next = cpu;
+  next.profiler = nullptr;
+  next.input_latency = nullptr;
+  while (next.pc != branch_pc) {
+    cycle_cpu(next);
+  }
+  uint8_t opcode = cpu.ram[branch_pc];
+  if (opcode == 0xC3 || evaluate_condition(next, (opcode >> 3) & 0b111)) {
+    next.pc = cpu.pc;
+    if (same_spin_state(get_spin_signature(next, branch_pc), signature)) {
+      cpu.halt = true;
+    }
+  }
+  cpu.spin_signature = signature;
+}
+
+uint32_t jump(CPUState& cpu, uint16_t addr) {
+  uint16_t branch_pc = cpu.pc;
+  cpu.pc = addr;
+  if (cpu.pc <= branch_pc) {
+    detect_spin_loop(cpu, branch_pc);
+  }
+  return 10;
+}
+
+template <uint8_t condition_flag>
+uint32_t conditional_jump(CPUState& cpu, uint16_t addr) {
+  if (evaluate_condition<condition_flag>(cpu)) {
+    jump(cpu, addr);
   } else {
     cpu.pc += 3;
   }
 
-  // TODO: Figure out if this is correct.
-  return 3;
+  return 10;
 }
 
-uint32_t call(CPUState& cpu) {
-  uint16_t addr = cpu.get_immediate_value16();
+uint32_t call(CPUState& cpu, uint16_t addr) {
   uint16_t next_instruction = cpu.pc + 3;
   cpu.push_stack(next_instruction);
   cpu.pc = addr;
 
-  return 5;
+  return 17;
 }
 
-uint32_t condition_call(uint8_t condition_flag, CPUState& cpu) {
-  if (evaluate_condition(condition_flag, cpu)) {
-    return call(cpu);
+template <uint8_t condition_flag>
+uint32_t condition_call(CPUState& cpu, uint16_t addr) {
+  if (evaluate_condition<condition_flag>(cpu)) {
+    return call(cpu, addr);
   } else {
     cpu.pc += 3;
   }
 
-  return 3;
+  return 11;
 }
 
 uint32_t return_from_subroutine(CPUState& cpu) {
   uint16_t addr = cpu.pop_stack();
   cpu.pc = addr;
 
-  return 3;
+  return 10;
 }
 
-uint32_t conditional_return(uint8_t condition_flag, CPUState& cpu) {
-  if (evaluate_condition(condition_flag, cpu)) {
-    return return_from_subroutine(cpu);
+template <uint8_t condition_flag>
+uint32_t conditional_return(CPUState& cpu) {
+  if (evaluate_condition<condition_flag>(cpu)) {
+    return return_from_subroutine(cpu) + 1;
   } else {
     cpu.pc++;
   }
 
-  return 1;
+  return 5;
 }
 
-uint32_t restart(uint8_t restart_code, CPUState& cpu) {
+template <uint8_t restart_code>
+uint32_t restart(CPUState& cpu) {
   uint16_t next_instruction = cpu.pc + 1;
   cpu.push_stack(next_instruction);
   cpu.pc = restart_code << 3; // Multiply by 8
 
-  return 3;
+  return 11;
 }
 
 uint32_t jump_to_hl(CPUState& cpu) {
   cpu.pc = cpu.get_register_pair_value(HL_REGISTER);
-  return 1;
+  return 5;
 }
 
 // ========================================
 // Stack, I/O, and Machine Control Group
 // ========================================
 
-uint32_t push(uint8_t reg_pair, CPUState& cpu) {
-  if (reg_pair == SP_REGISTER) {
-    throw std::runtime_error("Error: Cannot push SP register.");
-  }
+template <uint8_t reg_pair>
+uint32_t push(CPUState& cpu) {
+  static_assert(reg_pair != SP_REGISTER, "Cannot push SP register.");
   uint16_t value = cpu.get_register_pair_value(reg_pair);
   cpu.push_stack(value);
   cpu.pc++;
 
-  return 3;
+  return 11;
 }
 
-uint32_t pop(uint8_t reg_pair, CPUState& cpu) {
-  if (reg_pair == SP_REGISTER) {
-    throw std::runtime_error("Error: Cannot pop SP register.");
-  }
+template <uint8_t reg_pair>
+uint32_t pop(CPUState& cpu) {
+  static_assert(reg_pair != SP_REGISTER, "Cannot pop SP register.");
   uint16_t value = cpu.pop_stack();
-  *cpu.register_pair_low[reg_pair] = value & 0xFF;
-  *cpu.register_pair_high[reg_pair] = value >> 8;
+  cpu.set_register_pair_value(reg_pair, value);
   cpu.pc++;
 
-  return 3;
+  return 10;
 }
 
 uint32_t push_processor_state(CPUState& cpu) {
-  uint8_t low_byte = cpu.a;
+  materialize_flags(cpu);
+  uint8_t low_byte = cpu.a();
   uint8_t high_byte = 0;
   high_byte |= cpu.sign << 7;
   high_byte |= cpu.zero << 6;
@@ -682,7 +820,7 @@ uint32_t push_processor_state(CPUState& cpu) {
   cpu.push_stack(value);
   cpu.pc++;
 
-  return 3;
+  return 11;
 }
 
 uint32_t pop_processor_state(CPUState& cpu) {
@@ -690,7 +828,8 @@ uint32_t pop_processor_state(CPUState& cpu) {
   uint8_t low_byte = value & 0xFF;
   uint8_t high_byte = value >> 8;
 
-  cpu.a = low_byte;
+  cpu.a() = low_byte;
+  cpu.pending_flags = 0;
   cpu.sign = high_byte & 0x80;
   cpu.zero = high_byte & 0x40;
   cpu.aux_carry = high_byte & 0x10;
@@ -698,49 +837,50 @@ uint32_t pop_processor_state(CPUState& cpu) {
   cpu.carry = high_byte & 0x01;
   cpu.pc++;
 
-  return 3;
+  return 10;
 }
 
 uint32_t exchange_stack_top_with_hl(CPUState& cpu) {
   uint16_t stack_top = cpu.pop_stack();
   uint16_t hl = cpu.get_register_pair_value(HL_REGISTER);
   cpu.push_stack(hl);
-  *cpu.register_pair_low[HL_REGISTER] = stack_top & 0xFF;
-  *cpu.register_pair_high[HL_REGISTER] = stack_top >> 8;
+  cpu.set_register_pair_value(HL_REGISTER, stack_top);
   cpu.pc++;
 
-  return 5;
+  return 18;
 }
 
 uint32_t move_hl_to_stack_pointer(CPUState& cpu) {
   cpu.sp = cpu.get_register_pair_value(HL_REGISTER);
   cpu.pc++;
 
-  return 1;
+  return 5;
 }
 
 // Special shift register instructions via the IN and OUT instructions.
 void transfer_to_shift_register(CPUState& cpu) {
   // Stores the accumulator in the shift register.
   // Puts it in the most significant byte and moves the previous value to the least significant byte.
-  cpu.shift_register = cpu.shift_register >> 8 | cpu.a << 8;
+  cpu.shift_register = cpu.shift_register >> 8 | cpu.a() << 8;
 }
 
 void transfer_to_shift_offset(CPUState& cpu) {
   // Stores the least significant 3 bits of the accumulator in the shift offset.
   // Since the shift register can only shift by 0-7 bits, we only need 3 bits.
-  cpu.shift_offset = cpu.a & 0x7;
+  cpu.shift_offset = cpu.a() & 0x7;
 }
 
 void transfer_from_shift_register(CPUState& cpu) {
   // Completes the shift operation requested by the OUT instructions.
-  cpu.a = (cpu.shift_register >> (8 - cpu.shift_offset)) & 0xFF;
+  cpu.a() = (cpu.shift_register >> (8 - cpu.shift_offset)) & 0xFF;
 }
 
-uint32_t input_from_port(CPUState& cpu) {
-  uint8_t port = cpu.get_immediate_value8();
+uint32_t input_from_port(CPUState& cpu, uint16_t port) {
   if (port < 3) {
-    cpu.a = cpu.input_ports[port];
+    cpu.a() = cpu.input_ports[port];
+  }
+  if (port == 1 && cpu.input_latency) [[unlikely]] {
+    cpu.input_latency->guest_read();
   }
   
   switch (port) {
@@ -750,13 +890,12 @@ uint32_t input_from_port(CPUState& cpu) {
   }
 
   cpu.pc += 2;
-  return 3;
+  return 10;
 }
 
-uint32_t output_to_port(CPUState& cpu) {
-  uint8_t port = cpu.get_immediate_value8();
+uint32_t output_to_port(CPUState& cpu, uint16_t port) {
 
-  // Output is cpu.a
+  // Output is cpu.a()
   switch (port) {
     case 2:
       transfer_to_shift_offset(cpu);
@@ -767,385 +906,613 @@ uint32_t output_to_port(CPUState& cpu) {
   }
 
   cpu.pc += 2;
-  return 3;
+  return 10;
 }
 
 uint32_t enable_interrupts(CPUState& cpu) {
   cpu.enable_interrupt = true;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t disable_interrupts(CPUState& cpu) {
   cpu.enable_interrupt = false;
   cpu.pc++;
 
-  return 1;
+  return 4;
 }
 
 uint32_t halt(CPUState& cpu) {
+  // Waits for the next interrupt, see interrupt_cpu.
   cpu.halt = true;
   cpu.pc++;
 
-  return 1;
+  return 7;
+}
+
+// ========================================
+// Fused Instructions
+// ========================================
+
+// Whether `count` bytes from `addr` can be written at once, i.e. they don't wrap around and no translated code
+// lives there (which would have to be invalidated by the write).
+bool is_bulk_writable(CPUState& cpu, uint16_t addr, uint32_t count) {
+  if (addr + count > 0x10000) {
+    return false;
+  }
+  for (uint32_t page = addr >> 8; page <= (addr + count - 1) >> 8; page++) {
+    if (cpu.code_pages[page]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the last store overwrote the code of the running block, which then has to stop right there.
+bool is_block_invalidated(CPUState& cpu) {
+  return cpu.block_cache && cpu.block_cache->invalidated;
+}
+
+// Instructions in one iteration of each fused loop.
+constexpr uint32_t fused_pattern_lengths[FUSED_PATTERN_COUNT] = { 6, 4 };
+
+void count_fused(CPUState& cpu, FusedPattern pattern, uint32_t bulk_iterations) {
+  // The iterations run through the handlers count themselves, and the block counts the fused instruction once.
+  // Without bulk iterations that is one less, so the sum mustn't be taken in 32 bits.
+  cpu.instructions += (uint64_t)bulk_iterations * fused_pattern_lengths[pattern];
+  cpu.instructions -= 1;
+
+  if (cpu.block_cache) {
+    cpu.block_cache->fused_executions[pattern]++;
+    cpu.block_cache->fused_iterations[pattern] += bulk_iterations;
+  }
+}
+
+// LDAX D / MOV M,A / INX H / INX D / DCR B / JNZ start
+uint32_t copy_loop_iteration(CPUState& cpu) {
+  uint32_t cycles = load_accumulator_indirect<DE_REGISTER>(cpu);
+  cycles += move_to_hl_indirect<A_REGISTER>(cpu);
+  cpu.instructions += 2;
+  if (is_block_invalidated(cpu)) {
+    return cycles;
+  }
+  cpu.instructions += 4;
+  cycles += increment_register_pair<HL_REGISTER>(cpu);
+  cycles += increment_register_pair<DE_REGISTER>(cpu);
+  cycles += decrement_register<B_REGISTER>(cpu);
+  cycles += conditional_jump<NOT_ZERO_FLAG>(cpu, cpu.get_immediate_value16());
+  return cycles;
+}
+
+uint32_t copy_loop(CPUState& cpu) {
+  uint16_t start = cpu.pc;
+
+  // The first iteration runs as usual, every iteration that loops back costs the same.
+  uint32_t iteration_cycles = copy_loop_iteration(cpu);
+  uint32_t cycles = iteration_cycles;
+
+  // Copy all but the last of the remaining bytes at once, the last iteration leaves the flags and the PC.
+  uint32_t count = cpu.pc == start ? cpu.b() - 1 : 0;
+  uint16_t src = cpu.get_register_pair_value(DE_REGISTER);
+  uint16_t dst = cpu.get_register_pair_value(HL_REGISTER);
+  if (count > 0 && src + count <= 0x10000 && is_bulk_writable(cpu, dst, count)) {
+    if (dst <= src || dst >= src + count) {
+      memmove(cpu.ram + dst, cpu.ram + src, count);
+    } else {
+      // Overlapping forwards, byte by byte repeats the source like the loop does.
+      for (uint32_t i = 0; i < count; i++) {
+        cpu.ram[dst + i] = cpu.ram[src + i];
+      }
+    }
+    cpu.a() = cpu.ram[dst + count - 1];
+    cpu.set_register_pair_value(DE_REGISTER, src + count);
+    cpu.set_register_pair_value(HL_REGISTER, dst + count);
+    cpu.b() = 1;
+    cycles += count * iteration_cycles;
+    cycles += copy_loop_iteration(cpu);
+    count_fused(cpu, FUSED_COPY_LOOP, count);
+  } else {
+    count_fused(cpu, FUSED_COPY_LOOP, 0);
+  }
+
+  return cycles;
+}
+
+// MOV M,A / INX H / DCR B / JNZ start
+uint32_t fill_loop_iteration(CPUState& cpu) {
+  uint32_t cycles = move_to_hl_indirect<A_REGISTER>(cpu);
+  cpu.instructions++;
+  if (is_block_invalidated(cpu)) {
+    return cycles;
+  }
+  cpu.instructions += 3;
+  cycles += increment_register_pair<HL_REGISTER>(cpu);
+  cycles += decrement_register<B_REGISTER>(cpu);
+  cycles += conditional_jump<NOT_ZERO_FLAG>(cpu, cpu.get_immediate_value16());
+  return cycles;
+}
+
+uint32_t fill_loop(CPUState& cpu) {
+  uint16_t start = cpu.pc;
+
+  uint32_t iteration_cycles = fill_loop_iteration(cpu);
+  uint32_t cycles = iteration_cycles;
+
+  uint32_t count = cpu.pc == start ? cpu.b() - 1 : 0;
+  uint16_t dst = cpu.get_register_pair_value(HL_REGISTER);
+  if (count > 0 && is_bulk_writable(cpu, dst, count)) {
+    memset(cpu.ram + dst, cpu.a(), count);
+    cpu.set_register_pair_value(HL_REGISTER, dst + count);
+    cpu.b() = 1;
+    cycles += count * iteration_cycles;
+    cycles += fill_loop_iteration(cpu);
+    count_fused(cpu, FUSED_FILL_LOOP, count);
+  } else {
+    count_fused(cpu, FUSED_FILL_LOOP, 0);
+  }
+
+  return cycles;
+}
+
+// ========================================
+// Instruction Decoding
+// ========================================
+
+uint32_t unimplemented_opcode(CPUState& cpu) {
+  throw std::runtime_error("Error: Unimplemented opcode " + std::to_string(cpu.ram[cpu.pc]));
 }
 
-void init_cpu_state(CPUState& cpu) {
+// Resolves the handler for an opcode from its bit fields at compile time, so every register, register pair
+// and condition variant is its own template instantiation. Instructions with immediate data get it as a parameter
+// (a PredecodedInstruction), the others only take the CPU (an Instruction).
+template <uint8_t opcode>
+constexpr auto decode_handler() {
+  constexpr uint8_t ddd = (opcode >> 3) & 0b111;
+  constexpr uint8_t sss = opcode & 0b111;
+  constexpr uint8_t rp = (opcode >> 4) & 0b11;
+  constexpr uint8_t ccc = ddd;
+
   // No Operation - 00-000-000
-  cpu.opcodes[0x00] = nop;
+  if constexpr (opcode == 0x00) return nop;
 
   // ========================================
   // Data Transfer Group
   // ========================================
-  for (uint8_t r1 : cpu.register_masks) {
-    // Move Immediate to Register (r1) - 00-ddd-110
-    cpu.opcodes[0x06 | r1 << 3] = [r1](CPUState& cpu) {
-      return move_immediate(r1, cpu);
-    };
-    
-    for (uint8_t r2 : cpu.register_masks) {
-      // Move Register Instructions (r1, r2) - 01-ddd-sss
-      cpu.opcodes[0x40 | r1 << 3 | r2] = [r1, r2](CPUState& cpu) {
-        return move_register(r1, r2, cpu);
-      };
-    }
 
-    // Move from memory location stored in HL to register (r1) - 01-ddd-110
-    cpu.opcodes[0x46 | r1 << 3] = [r1](CPUState& cpu) {
-      return move_from_hl_indirect(r1, cpu);
-    };
+  // Halt - 01-110-110 (takes the slot of MOV M, M)
+  else if constexpr (opcode == 0x76) return halt;
 
-    // Move register (r1) to memory location stored in HL - 01-110-sss
-    cpu.opcodes[0x70 | r1] = [r1](CPUState& cpu) {
-      return move_to_hl_indirect(r1, cpu);
-    };
-  }
+  // Move from memory location stored in HL to register (r1) - 01-ddd-110
+  else if constexpr ((opcode & 0b11000111) == 0x46) return move_from_hl_indirect<ddd>;
+
+  // Move register (r1) to memory location stored in HL - 01-110-sss
+  else if constexpr ((opcode & 0b11111000) == 0x70) return move_to_hl_indirect<sss>;
+
+  // Move Register Instructions (r1, r2) - 01-ddd-sss
+  else if constexpr ((opcode & 0b11000000) == 0x40) return move_register<ddd, sss>;
 
   // Move immediate data (next byte) to memory location stored in HL - 00-110-110
-  cpu.opcodes[0x36] = move_to_memory_immediate;
+  else if constexpr (opcode == 0x36) return move_to_memory_immediate;
 
-  for (uint8_t rp : cpu.register_pair_masks) {
-    // Load register pair immediate - 00-rp-0001
-    cpu.opcodes[0x01 | rp << 4] = [rp](CPUState& cpu) {
-      return load_register_pair_immediate(rp, cpu);
-    };
-  }
+  // Move Immediate to Register (r1) - 00-ddd-110
+  else if constexpr ((opcode & 0b11000111) == 0x06) return move_immediate<ddd>;
+
+  // Load register pair immediate - 00-rp-0001
+  else if constexpr ((opcode & 0b11001111) == 0x01) return load_register_pair_immediate<rp>;
 
   // Load accumulator direct - 00-111-010
-  cpu.opcodes[0x3A] = load_accumulator_direct;
+  else if constexpr (opcode == 0x3A) return load_accumulator_direct;
 
-  // Store accumulator direct - 00-110-110
-  cpu.opcodes[0x32] = store_accumulator_direct;
+  // Store accumulator direct - 00-110-010
+  else if constexpr (opcode == 0x32) return store_accumulator_direct;
 
   // Load HL direct - 00-101-010
-  cpu.opcodes[0x2A] = load_hl_direct;
+  else if constexpr (opcode == 0x2A) return load_hl_direct;
 
   // Store HL direct - 00-100-010
-  cpu.opcodes[0x22] = store_hl_direct;
+  else if constexpr (opcode == 0x22) return store_hl_direct;
 
   // Load accumulator indirect - 00-rp-1010 (only BC and DE registers are supported)
-  cpu.opcodes[0x0A | BC_REGISTER << 4] = [](CPUState& cpu) {
-    return load_accumulator_indirect(BC_REGISTER, cpu);
-  };
-  cpu.opcodes[0x0A | DE_REGISTER << 4] = [](CPUState& cpu) {
-    return load_accumulator_indirect(DE_REGISTER, cpu);
-  };
+  else if constexpr (opcode == 0x0A || opcode == 0x1A) return load_accumulator_indirect<rp>;
 
   // Store accumulator indirect - 00-rp-0010 (only BC and DE registers are supported)
-  cpu.opcodes[0x02 | BC_REGISTER << 4] = [](CPUState& cpu) {
-    return store_accumulator_indirect(BC_REGISTER, cpu);
-  };
-  cpu.opcodes[0x02 | DE_REGISTER << 4] = [](CPUState& cpu) {
-    return store_accumulator_indirect(DE_REGISTER, cpu);
-  };
+  else if constexpr (opcode == 0x02 || opcode == 0x12) return store_accumulator_indirect<rp>;
 
   // Exchange HL and DE - 11-101-011
-  cpu.opcodes[0xEB] = exchange_hl_and_de;
+  else if constexpr (opcode == 0xEB) return exchange_hl_and_de;
 
   // ========================================
   // Arithmetic Group
   // ========================================
 
-  // Add Register - 10-000-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x80 | r] = [r](CPUState& cpu) {
-      return add_register(r, cpu);
-    };
-  }
-
   // Add Memory - 10-000-110
-  cpu.opcodes[0x86] = add_memory;
+  else if constexpr (opcode == 0x86) return add_memory;
 
-  // Add Immediate - 11-000-110
-  cpu.opcodes[0xC6] = add_immediate;
+  // Add Register - 10-000-sss
+  else if constexpr ((opcode & 0b11111000) == 0x80) return add_register<sss>;
 
-  // Add Register with carry - 10-001-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x88 | r] = [r](CPUState& cpu) {
-      return add_register_with_carry(r, cpu);
-    };
-  }
+  // Add Immediate - 11-000-110
+  else if constexpr (opcode == 0xC6) return add_immediate;
 
   // Add Memory with carry - 10-001-110
-  cpu.opcodes[0x8E] = add_memory_with_carry;
+  else if constexpr (opcode == 0x8E) return add_memory_with_carry;
 
-  // Add Immediate with carry - 11-001-110
-  cpu.opcodes[0xCE] = add_immediate_with_carry;
+  // Add Register with carry - 10-001-sss
+  else if constexpr ((opcode & 0b11111000) == 0x88) return add_register_with_carry<sss>;
 
-  // Subtract Register - 10-010-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x90 | r] = [r](CPUState& cpu) {
-      return subtract_register(r, cpu);
-    };
-  }
+  // Add Immediate with carry - 11-001-110
+  else if constexpr (opcode == 0xCE) return add_immediate_with_carry;
 
   // Subtract Memory - 10-010-110
-  cpu.opcodes[0x96] = subtract_memory;
+  else if constexpr (opcode == 0x96) return subtract_memory;
 
-  // Subtract Immediate - 11-010-110
-  cpu.opcodes[0xD6] = subtract_immediate;
+  // Subtract Register - 10-010-sss
+  else if constexpr ((opcode & 0b11111000) == 0x90) return subtract_register<sss>;
 
-  // Subtract Register with borrow - 10-011-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x98 | r] = [r](CPUState& cpu) {
-      return subtract_register_with_borrow(r, cpu);
-    };
-  }
+  // Subtract Immediate - 11-010-110
+  else if constexpr (opcode == 0xD6) return subtract_immediate;
 
   // Subtract Memory with borrow - 10-011-110
-  cpu.opcodes[0x9E] = subtract_memory_with_borrow;
+  else if constexpr (opcode == 0x9E) return subtract_memory_with_borrow;
 
-  // Subtract Immediate with borrow - 11-011-110
-  cpu.opcodes[0xDE] = subtract_immediate_with_borrow;
+  // Subtract Register with borrow - 10-011-sss
+  else if constexpr ((opcode & 0b11111000) == 0x98) return subtract_register_with_borrow<sss>;
 
-  // Increment Register - 00-ddd-100
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x04 | r << 3] = [r](CPUState& cpu) {
-      return increment_register(r, cpu);
-    };
-  }
+  // Subtract Immediate with borrow - 11-011-110
+  else if constexpr (opcode == 0xDE) return subtract_immediate_with_borrow;
 
   // Increment Memory - 00-110-100
-  cpu.opcodes[0x34] = increment_memory_op;
+  else if constexpr (opcode == 0x34) return increment_memory_op;
 
-  // Decrement Register - 00-ddd-101
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0x05 | r << 3] = [r](CPUState& cpu) {
-      return decrement_register(r, cpu);
-    };
-  }
+  // Increment Register - 00-ddd-100
+  else if constexpr ((opcode & 0b11000111) == 0x04) return increment_register<ddd>;
 
   // Decrement Memory - 00-110-101
-  cpu.opcodes[0x35] = decrement_memory_op;
+  else if constexpr (opcode == 0x35) return decrement_memory_op;
+
+  // Decrement Register - 00-ddd-101
+  else if constexpr ((opcode & 0b11000111) == 0x05) return decrement_register<ddd>;
 
   // Increment Register Pair - 00-rp-0011
-  for (uint8_t rp : cpu.register_pair_masks) {
-    cpu.opcodes[0x03 | rp << 4] = [rp](CPUState& cpu) {
-      return increment_register_pair(rp, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11001111) == 0x03) return increment_register_pair<rp>;
 
   // Decrement Register Pair - 00-rp-1011
-  for (uint8_t rp : cpu.register_pair_masks) {
-    cpu.opcodes[0x0B | rp << 4] = [rp](CPUState& cpu) {
-      return decrement_register_pair(rp, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11001111) == 0x0B) return decrement_register_pair<rp>;
 
   // Add Register Pair to HL - 00-rp-1001
-  for (uint8_t rp : cpu.register_pair_masks) {
-    cpu.opcodes[0x09 | rp << 4] = [rp](CPUState& cpu) {
-      return add_register_pair_to_hl(rp, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11001111) == 0x09) return add_register_pair_to_hl<rp>;
 
   // Decimal Adjust Accumulator - 00-100-111
-  cpu.opcodes[0x27] = decimal_adjust_accumulator;
+  else if constexpr (opcode == 0x27) return decimal_adjust_accumulator;
 
   // ========================================
   // Logical Group
   // ========================================
 
-  // AND Register - 10-100-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0xA0 | r] = [r](CPUState& cpu) {
-      return and_register(r, cpu);
-    };
-  }
-
   // AND Memory - 10-100-110
-  cpu.opcodes[0xA6] = and_memory;
+  else if constexpr (opcode == 0xA6) return and_memory;
 
-  // AND Immediate - 11-100-110
-  cpu.opcodes[0xE6] = and_immediate;
+  // AND Register - 10-100-sss
+  else if constexpr ((opcode & 0b11111000) == 0xA0) return and_register<sss>;
 
-  // Exclusive OR Register - 10-101-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0xA8 | r] = [r](CPUState& cpu) {
-      return xor_register(r, cpu);
-    };
-  }
+  // AND Immediate - 11-100-110
+  else if constexpr (opcode == 0xE6) return and_immediate;
 
   // Exclusive OR Memory - 10-101-110
-  cpu.opcodes[0xAE] = xor_memory;
+  else if constexpr (opcode == 0xAE) return xor_memory;
 
-  // Exclusive OR Immediate - 11-101-110
-  cpu.opcodes[0xEE] = xor_immediate;
+  // Exclusive OR Register - 10-101-sss
+  else if constexpr ((opcode & 0b11111000) == 0xA8) return xor_register<sss>;
 
-  // OR Register - 10-110-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0xB0 | r] = [r](CPUState& cpu) {
-      return or_register(r, cpu);
-    };
-  }
+  // Exclusive OR Immediate - 11-101-110
+  else if constexpr (opcode == 0xEE) return xor_immediate;
 
   // OR Memory - 10-110-110
-  cpu.opcodes[0xB6] = or_memory;
+  else if constexpr (opcode == 0xB6) return or_memory;
 
-  // OR Immediate - 11-110-110
-  cpu.opcodes[0xF6] = or_immediate;
+  // OR Register - 10-110-sss
+  else if constexpr ((opcode & 0b11111000) == 0xB0) return or_register<sss>;
 
-  // Compare Register - 10-111-sss
-  for (uint8_t r : cpu.register_masks) {
-    cpu.opcodes[0xB8 | r] = [r](CPUState& cpu) {
-      return compare_register(r, cpu);
-    };
-  }
+  // OR Immediate - 11-110-110
+  else if constexpr (opcode == 0xF6) return or_immediate;
 
   // Compare Memory - 10-111-110
-  cpu.opcodes[0xBE] = compare_memory;
+  else if constexpr (opcode == 0xBE) return compare_memory;
+
+  // Compare Register - 10-111-sss
+  else if constexpr ((opcode & 0b11111000) == 0xB8) return compare_register<sss>;
 
   // Compare Immediate - 11-111-110
-  cpu.opcodes[0xFE] = compare_immediate;
+  else if constexpr (opcode == 0xFE) return compare_immediate;
 
   // Rotate Left - 00-000-111
-  cpu.opcodes[0x07] = rotate_left;
+  else if constexpr (opcode == 0x07) return rotate_left;
 
   // Rotate Right - 00-001-111
-  cpu.opcodes[0x0F] = rotate_right;
+  else if constexpr (opcode == 0x0F) return rotate_right;
 
   // Rotate Left through Carry - 00-010-111
-  cpu.opcodes[0x17] = rotate_left_through_carry;
+  else if constexpr (opcode == 0x17) return rotate_left_through_carry;
 
   // Rotate Right through Carry - 00-011-111
-  cpu.opcodes[0x1F] = rotate_right_through_carry;
+  else if constexpr (opcode == 0x1F) return rotate_right_through_carry;
 
   // Complement Accumulator - 00-101-111
-  cpu.opcodes[0x2F] = complement_accumulator;
+  else if constexpr (opcode == 0x2F) return complement_accumulator;
 
   // Complement Carry - 00-111-111
-  cpu.opcodes[0x3F] = complement_carry_flag;
+  else if constexpr (opcode == 0x3F) return complement_carry_flag;
 
   // Set Carry - 00-110-111
-  cpu.opcodes[0x37] = set_carry_flag;
+  else if constexpr (opcode == 0x37) return set_carry_flag;
 
   // ========================================
   // Branch Group
   // ========================================
 
   // Jump - 11-000-011
-  cpu.opcodes[0xC3] = jump;
+  else if constexpr (opcode == 0xC3) return jump;
 
   // Conditional Jump - 11-ccc-010
-  for (uint8_t condition_flag : cpu.condition_flags) {
-    cpu.opcodes[0xC2 | condition_flag << 3] = [condition_flag](CPUState& cpu) {
-      return conditional_jump(condition_flag, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11000111) == 0xC2) return conditional_jump<ccc>;
 
   // Call - 11-001-101
-  cpu.opcodes[0xCD] = call;
+  else if constexpr (opcode == 0xCD) return call;
 
   // Conditional Call - 11-ccc-100
-  for (uint8_t condition_flag : cpu.condition_flags) {
-    cpu.opcodes[0xC4 | condition_flag << 3] = [condition_flag](CPUState& cpu) {
-      return condition_call(condition_flag, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11000111) == 0xC4) return condition_call<ccc>;
 
   // Return - 11-001-001
-  cpu.opcodes[0xC9] = return_from_subroutine;
+  else if constexpr (opcode == 0xC9) return return_from_subroutine;
 
   // Conditional Return - 11-ccc-000
-  for (uint8_t condition_flag : cpu.condition_flags) {
-    cpu.opcodes[0xC0 | condition_flag << 3] = [condition_flag](CPUState& cpu) {
-      return conditional_return(condition_flag, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11000111) == 0xC0) return conditional_return<ccc>;
 
   // Restart - 11-nnn-111 (nnn = 0-7)
-  for (uint8_t restart_code = 0; restart_code < 8; restart_code++) {
-    cpu.opcodes[0xC7 | restart_code << 3] = [restart_code](CPUState& cpu) {
-      return restart(restart_code, cpu);
-    };
-  }
+  else if constexpr ((opcode & 0b11000111) == 0xC7) return restart<ddd>;
 
   // Jump to HL - 11-101-001
-  cpu.opcodes[0xE9] = jump_to_hl;
+  else if constexpr (opcode == 0xE9) return jump_to_hl;
 
   // ========================================
   // Stack, I/O, and Machine Control Group
   // ========================================
 
-  // Push Register Pair - 11-rp-0101
-  for (uint8_t rp : cpu.register_pair_masks) {
-    cpu.opcodes[0xC5 | rp << 4] = [rp](CPUState& cpu) {
-      return push(rp, cpu);
-    };
-  }
-
-  // Pop Register Pair - 11-rp-0001
-  for (uint8_t rp : cpu.register_pair_masks) {
-    cpu.opcodes[0xC1 | rp << 4] = [rp](CPUState& cpu) {
-      return pop(rp, cpu);
-    };
-  }
-
   // Push Processor State - 11-110-101
-  cpu.opcodes[0xF5] = push_processor_state;
+  else if constexpr (opcode == 0xF5) return push_processor_state;
+
+  // Push Register Pair - 11-rp-0101
+  else if constexpr ((opcode & 0b11001111) == 0xC5) return push<rp>;
 
   // Pop Processor State - 11-110-001
-  cpu.opcodes[0xF1] = pop_processor_state;
+  else if constexpr (opcode == 0xF1) return pop_processor_state;
+
+  // Pop Register Pair - 11-rp-0001
+  else if constexpr ((opcode & 0b11001111) == 0xC1) return pop<rp>;
 
   // Exchange Stack Top with HL - 11-100-011
-  cpu.opcodes[0xE3] = exchange_stack_top_with_hl;
+  else if constexpr (opcode == 0xE3) return exchange_stack_top_with_hl;
 
   // Move HL to Stack Pointer - 11-111-001
-  cpu.opcodes[0xF9] = move_hl_to_stack_pointer;
+  else if constexpr (opcode == 0xF9) return move_hl_to_stack_pointer;
 
   // Input - 11-011-011
-  cpu.opcodes[0xDB] = input_from_port;
+  else if constexpr (opcode == 0xDB) return input_from_port;
 
   // Output - 11-010-011
-  cpu.opcodes[0xD3] = output_to_port;
+  else if constexpr (opcode == 0xD3) return output_to_port;
 
   // Enable Interrupts - 11-111-011
-  cpu.opcodes[0xFB] = enable_interrupts;
+  else if constexpr (opcode == 0xFB) return enable_interrupts;
 
   // Disable Interrupts - 11-110-011
-  cpu.opcodes[0xF3] = disable_interrupts;
+  else if constexpr (opcode == 0xF3) return disable_interrupts;
 
-  // Halt - 01-110-110
-  cpu.opcodes[0x76] = halt;
+  else return unimplemented_opcode;
 }
 
-uint32_t cycle_cpu(CPUState& cpu) {
-  uint8_t opcode = cpu.ram[cpu.pc];
-  auto instruction_it = cpu.opcodes.find(opcode);
-  if (instruction_it == cpu.opcodes.end()) {
-    throw std::runtime_error("Error: Unimplemented opcode " + std::to_string(opcode));
+// Reads the immediate data following the opcode for a handler taking it as a parameter.
+template <PredecodedInstruction handler, uint8_t length>
+uint32_t fetch_operand(CPUState& cpu) {
+  if constexpr (length == 3) {
+    return handler(cpu, cpu.get_immediate_value16());
+  } else {
+    return handler(cpu, cpu.get_immediate_value8());
+  }
+}
+
+template <Instruction handler>
+uint32_t ignore_operand(CPUState& cpu, uint16_t) {
+  return handler(cpu);
+}
+
+template <uint8_t opcode>
+constexpr Instruction decode_instruction() {
+  constexpr auto handler = decode_handler<opcode>();
+  if constexpr (std::is_same_v<decltype(handler), const PredecodedInstruction>) {
+    return fetch_operand<handler, get_instruction_length(opcode)>;
+  } else {
+    return handler;
+  }
+}
+
+template <uint8_t opcode>
+constexpr PredecodedInstruction decode_predecoded_instruction() {
+  constexpr auto handler = decode_handler<opcode>();
+  if constexpr (std::is_same_v<decltype(handler), const PredecodedInstruction>) {
+    return handler;
+  } else {
+    return ignore_operand<handler>;
   }
+}
+
+template <size_t... opcodes>
+constexpr std::array<Instruction, 256> make_opcode_table(std::index_sequence<opcodes...>) {
+  return { decode_instruction<opcodes>()... };
+}
+
+template <size_t... opcodes>
+constexpr std::array<PredecodedInstruction, 256> make_predecoded_table(std::index_sequence<opcodes...>) {
+  return { decode_predecoded_instruction<opcodes>()... };
+}
+
+// Flat dispatch tables indexed by opcode, built entirely at compile time.
+constexpr std::array<Instruction, 256> opcode_table = make_opcode_table(std::make_index_sequence<256>());
+constexpr std::array<PredecodedInstruction, 256> predecoded_table = make_predecoded_table(std::make_index_sequence<256>());
+
+Instruction get_instruction(uint8_t opcode) {
+  return opcode_table[opcode];
+}
+
+PredecodedInstruction get_predecoded_instruction(uint8_t opcode) {
+  return predecoded_table[opcode];
+}
+
+PredecodedInstruction get_fused_instruction(FusedPattern pattern) {
+  switch (pattern) {
+    case FUSED_COPY_LOOP:
+      return ignore_operand<copy_loop>;
+    case FUSED_FILL_LOOP:
+      return ignore_operand<fill_loop>;
+    default:
+      return nullptr;
+  }
+}
+
+bool is_side_effect_free(const uint8_t* ram, uint16_t start, uint16_t end) {
+  uint16_t pc = start;
+  for (int count = 0; pc != end; count++) {
+    uint8_t opcode = ram[pc];
+    bool writes = (opcode >= 0x70 && opcode <= 0x77) || opcode == 0x36 || opcode == 0x34 || opcode == 0x35
+      || opcode == 0x32 || opcode == 0x22 || opcode == 0x02 || opcode == 0x12;
+    bool machine = (opcode & 0b11001111) == 0xC5 || (opcode & 0b11001111) == 0xC1 || opcode == 0xE3 || opcode == 0xF9
+      || opcode == 0xDB || opcode == 0xD3 || opcode == 0xFB || opcode == 0xF3;
+    if (count == MAX_SPIN_LOOP_LENGTH || writes || machine || is_branch(opcode) || !is_implemented(opcode)) {
+      return false;
+    }
+    pc += get_instruction_length(opcode);
+  }
+  return true;
+}
+
+bool is_implemented(uint8_t opcode) {
+  return opcode_table[opcode] != unimplemented_opcode;
+}
+
+void invalidate_code(CPUState& cpu, uint16_t addr) {
+  uint8_t page = addr >> 8;
+  if (cpu.code_pages[page] & CODE_PAGE_BLOCKS) {
+    cpu.block_cache->invalidate_page(cpu, page);
+  }
+  if (cpu.code_pages[page] & CODE_PAGE_JIT) {
+    cpu.jit->invalidate_page(cpu, page);
+  }
+  if (cpu.code_pages[page] & CODE_PAGE_AOT) {
+    cpu.aot->invalidate_page(cpu, page);
+  }
+}
+
+void write_flagged_page(CPUState& cpu, uint16_t addr, uint8_t value) {
+  if (cpu.code_pages[addr >> 8] & CODE_PAGE_READ_ONLY) {
+    cpu.discarded_writes++;
+    return;
+  }
+  cpu.ram[addr] = value;
+  cpu.code_pages[addr >> 8] &= ~CODE_PAGE_CLEAN;
+  invalidate_code(cpu, addr);
+}
+
+void init_cpu_state([[maybe_unused]] CPUState& cpu) {
+  // Nothing to build, instruction dispatch is resolved at compile time (see opcode_table).
+}
+
+uint32_t cycle_cpu(CPUState& cpu) {
+  uint16_t pc = cpu.pc;
+  uint16_t sp = cpu.sp;
+  uint8_t opcode = cpu.ram[pc];
 
   // Execute the instruction.
-  auto cycles = instruction_it->second(cpu);
+  auto cycles = opcode_table[opcode](cpu);
+  cpu.instructions++;
+  if (cpu.profiler) [[unlikely]] {
+    cpu.profiler->record(cpu, pc, sp, opcode, cycles);
+  }
+  return cycles;
+}
+
+// Expands M once for every opcode (0x00 - 0xFF).
+#define OPCODE_ROW(M, high) \
+  M(high##0) M(high##1) M(high##2) M(high##3) M(high##4) M(high##5) M(high##6) M(high##7) \
+  M(high##8) M(high##9) M(high##A) M(high##B) M(high##C) M(high##D) M(high##E) M(high##F)
+#define FOR_EACH_OPCODE(M) \
+  OPCODE_ROW(M, 0x0) OPCODE_ROW(M, 0x1) OPCODE_ROW(M, 0x2) OPCODE_ROW(M, 0x3) \
+  OPCODE_ROW(M, 0x4) OPCODE_ROW(M, 0x5) OPCODE_ROW(M, 0x6) OPCODE_ROW(M, 0x7) \
+  OPCODE_ROW(M, 0x8) OPCODE_ROW(M, 0x9) OPCODE_ROW(M, 0xA) OPCODE_ROW(M, 0xB) \
+  OPCODE_ROW(M, 0xC) OPCODE_ROW(M, 0xD) OPCODE_ROW(M, 0xE) OPCODE_ROW(M, 0xF)
+
+uint32_t run_cycles(CPUState& cpu, uint32_t budget) {
+  uint32_t cycles = 0;
+  uint32_t executed = 0;
+  if (cpu.halt || budget == 0) {
+    return 0;
+  }
+
+#if defined(__GNUC__)
+  // Direct-threaded interpreter: every handler is inlined behind its own label and jumps straight
+  // to the next opcode's label, so there is no shared dispatch branch.
+  #define OPCODE_LABEL(opcode) &&op_##opcode,
+  #define OPCODE_HANDLER(opcode) \
+    op_##opcode: \
+      cycles += opcode_table[opcode](cpu); \
+      executed++; \
+      if (cycles >= budget || cpu.halt) goto done; \
+      goto *labels[cpu.ram[cpu.pc]];
+
+  static const void* const labels[256] = { FOR_EACH_OPCODE(OPCODE_LABEL) };
+
+  goto *labels[cpu.ram[cpu.pc]];
+  FOR_EACH_OPCODE(OPCODE_HANDLER)
+done:
+
+  #undef OPCODE_LABEL
+  #undef OPCODE_HANDLER
+#else
+  // Portable fallback, a switch the compiler can lower to a jump table.
+  #define OPCODE_CASE(opcode) \
+    case opcode: \
+      cycles += opcode_table[opcode](cpu); \
+      executed++; \
+      break;
+
+  while (cycles < budget && !cpu.halt) {
+    switch (cpu.ram[cpu.pc]) {
+      FOR_EACH_OPCODE(OPCODE_CASE)
+    }
+  }
+
+  #undef OPCODE_CASE
+#endif
+
+  cpu.instructions += executed;
   return cycles;
 }
 
 void interrupt_cpu(CPUState& cpu, uint8_t interrupt_num) {
   if (cpu.enable_interrupt) {
+    // Wakes the CPU from HLT (or a spin loop), the handler can change what the loop was waiting for.
+    cpu.halt = false;
+    cpu.spin_signature = {};
+
     cpu.push_stack(cpu.pc);
     cpu.pc = 8 * interrupt_num;
     cpu.enable_interrupt = false;
+
+    cpu.interrupts_delivered++;
+    if (cpu.profiler) [[unlikely]] {
+      cpu.profiler->record_interrupt(cpu);
+    }
+  } else {
+    cpu.interrupts_dropped++;
   }
 }
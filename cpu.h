@@ -1,5 +1,9 @@
-#include <map>
-#include <vector>
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
 #define A_REGISTER 0b111
 #define B_REGISTER 0b000
@@ -23,9 +27,54 @@
 #define SIGN_POSITIVE_FLAG 0b110
 #define SIGN_NEGATIVE_FLAG 0b111
 
-struct CPUState {
-  // Registers
-  uint8_t a = 0, b = 0, c = 0, d = 0, e = 0, h = 0, l = 0;
+// Flags in CPUState::code_pages, one per cache holding translated code from that page, one for pages the guest
+// can't write (the ROM, see protect_rom) and one for pages not written since their guest memory was last shared
+// (see attach_guest_memory).
+#define CODE_PAGE_BLOCKS (1 << 0)
+#define CODE_PAGE_JIT (1 << 1)
+#define CODE_PAGE_AOT (1 << 2)
+#define CODE_PAGE_READ_ONLY (1 << 3)
+#define CODE_PAGE_CLEAN (1 << 4)
+
+struct CPUState;
+struct BlockCache;
+struct Jit;
+struct Aot;
+struct TieredExecution;
+struct Profiler;
+struct InputLatency;
+
+// Notifies the code caches that translated code at `addr` was overwritten.
+void invalidate_code(CPUState& cpu, uint16_t addr);
+
+// Write to a page flagged in code_pages: discarded if read-only, otherwise stored, the page no longer clean and the
+// code caches notified.
+void write_flagged_page(CPUState& cpu, uint16_t addr, uint8_t value);
+
+// Index of an 8-bit register in CPUState::registers. Registers are stored in 8080 encoding order with the two
+// halves of each pair swapped on little-endian hosts, so BC, DE and HL can be read directly as 16-bit words.
+constexpr uint8_t register_index(uint8_t reg) {
+  return std::endian::native == std::endian::little ? reg ^ 1 : reg;
+}
+
+// Everything a loop iteration that doesn't write memory can change, see detect_spin_loop in cpu.cpp. The flags are
+// recorded as they are, lazy state included, and only compared by value once everything else matches.
+struct SpinSignature {
+  bool valid = false;
+  uint8_t flags = 0;
+  uint8_t pending_flags = 0;
+  uint16_t flag_result = 0;
+  uint16_t branch_pc = 0;
+  uint16_t sp = 0;
+  uint64_t registers = 0;
+};
+
+struct alignas(64) CPUState {
+  // Registers (B, C, D, E, H, L, A) and the register pairs BC, DE and HL overlaid on them.
+  union {
+    uint8_t registers[8] = {};
+    uint16_t register_pairs[4];
+  };
 
   // Special Registers
   uint16_t pc = 0, sp = 0xf000, shift_register = 0;
@@ -33,97 +82,208 @@ struct CPUState {
 
   // Flags
   bool zero = false, sign = false, parity = false, carry = false, aux_carry = false;
-  bool enable_interrupt = false, halt = false;
-
-  // Memory (64KB)
-  uint8_t* ram = new uint8_t[0x10000];
+  bool enable_interrupt = false;
+  bool halt = false; // Waiting for an interrupt, after HLT or in a loop that can only be left through one.
 
-  // Instruction Set
-  std::map<uint8_t, std::function<uint32_t(CPUState&)>> opcodes;
+  // Lazily evaluated flags (LAZY_FLAGS builds only), flags in pending_flags are yet to be derived from flag_result.
+  uint16_t flag_result = 0;
+  uint8_t pending_flags = 0;
 
   // Input Ports
   uint8_t input_ports[3] = {0, 0, 0};
 
-  // Register Map
-  std::map<uint8_t, uint8_t*> registers = {
-    {A_REGISTER, &a},
-    {B_REGISTER, &b},
-    {C_REGISTER, &c},
-    {D_REGISTER, &d},
-    {E_REGISTER, &e},
-    {H_REGISTER, &h},
-    {L_REGISTER, &l}
-  };
+  // Memory (64KB), owned by whoever set it up, usually a GuestMemory (see guest_memory.h).
+  uint8_t* ram = nullptr;
 
-  // Register Masks
-  std::vector<uint8_t> register_masks = {
-    A_REGISTER,
-    B_REGISTER,
-    C_REGISTER,
-    D_REGISTER,
-    E_REGISTER,
-    H_REGISTER,
-    L_REGISTER
-  };
+  // Code caches, writes to a page flagged in code_pages invalidate the code translated from it (or are discarded).
+  BlockCache* block_cache = nullptr;
+  Jit* jit = nullptr;
+  Aot* aot = nullptr;
+  uint8_t code_pages[256] = {};
 
-  // Register Pair Masks
-  std::vector<uint8_t> register_pair_masks = {
-    BC_REGISTER,
-    DE_REGISTER,
-    HL_REGISTER,
-    SP_REGISTER
-  };
+  // Execution tiers managing the code caches above, if attached.
+  TieredExecution* tiers = nullptr;
 
-  // Register Pair Map
-  std::map<uint8_t, uint8_t*> register_pair_high = {
-    {BC_REGISTER, &b},
-    {DE_REGISTER, &d},
-    {HL_REGISTER, &h},
-    {SP_REGISTER, (uint8_t*)&sp + 1}
-  };
-  std::map<uint8_t, uint8_t*> register_pair_low = {
-    {BC_REGISTER, &c},
-    {DE_REGISTER, &e},
-    {HL_REGISTER, &l},
-    {SP_REGISTER, (uint8_t*)&sp}
-  };
+  // State at the last backward jump, for spin loop detection.
+  SpinSignature spin_signature;
 
-  std::vector<uint8_t> condition_flags = {
-    NOT_ZERO_FLAG,
-    ZERO_FLAG,
-    NO_CARRY_FLAG,
-    CARRY_FLAG,
-    PARITY_ODD_FLAG,
-    PARITY_EVEN_FLAG,
-    SIGN_POSITIVE_FLAG,
-    SIGN_NEGATIVE_FLAG
-  };
+  // Instructions executed, counted by every execution engine.
+  uint64_t instructions = 0;
+
+  // Interrupts accepted, and those ignored because interrupts were disabled.
+  uint64_t interrupts_delivered = 0, interrupts_dropped = 0;
+
+  // Writes to read-only pages, discarded.
+  uint64_t discarded_writes = 0;
+
+  // Per-address and per-opcode instruction profile, if attached.
+  Profiler* profiler = nullptr;
+
+  // Notified when the guest reads input port 1, if attached.
+  InputLatency* input_latency = nullptr;
+
+  uint8_t& get_register(uint8_t reg) {
+    return registers[register_index(reg)];
+  }
+
+  uint8_t& a() { return get_register(A_REGISTER); }
+  uint8_t& b() { return get_register(B_REGISTER); }
+  uint8_t& c() { return get_register(C_REGISTER); }
+  uint8_t& d() { return get_register(D_REGISTER); }
+  uint8_t& e() { return get_register(E_REGISTER); }
+  uint8_t& h() { return get_register(H_REGISTER); }
+  uint8_t& l() { return get_register(L_REGISTER); }
 
   uint16_t get_immediate_value16() const {
-    return (ram[pc + 2] << 8) | ram[pc + 1];
+    return (ram[(uint16_t)(pc + 2)] << 8) | ram[(uint16_t)(pc + 1)];
   }
 
   uint8_t get_immediate_value8() const {
-    return ram[pc + 1];
+    return ram[(uint16_t)(pc + 1)];
   }
 
-  uint16_t get_register_pair_value(uint8_t const& reg_pair) const {
-    return (*register_pair_high.at(reg_pair) << 8) | *register_pair_low.at(reg_pair);
+  uint16_t get_register_pair_value(uint8_t reg_pair) const {
+    return reg_pair == SP_REGISTER ? sp : register_pairs[reg_pair];
+  }
+
+  void set_register_pair_value(uint8_t reg_pair, uint16_t value) {
+    if (reg_pair == SP_REGISTER) {
+      sp = value;
+    } else {
+      register_pairs[reg_pair] = value;
+    }
+  }
+
+  void write_memory(uint16_t addr, uint8_t value) {
+    if (code_pages[addr >> 8]) [[unlikely]] {
+      write_flagged_page(*this, addr, value);
+      return;
+    }
+    ram[addr] = value;
   }
 
   void push_stack(uint16_t value) {
     sp -= 2;
-    ram[sp] = value & 0xFF;
-    ram[sp + 1] = value >> 8;
+    write_memory(sp, value & 0xFF);
+    write_memory(sp + 1, value >> 8);
   }
 
   uint16_t pop_stack() {
-    uint16_t value = ram[sp] | (ram[sp + 1] << 8);
+    uint16_t value = ram[sp] | (ram[(uint16_t)(sp + 1)] << 8);
     sp += 2;
     return value;
   }
 };
 
+// Everything an instruction touches (except memory itself) lives in the first cache line.
+static_assert(offsetof(CPUState, ram) + sizeof(CPUState::ram) <= 64, "Hot CPU state must fit in one cache line");
+static_assert(std::is_trivially_copyable_v<CPUState>, "CPUState must be trivially copyable");
+
+// Instruction handler, returns the number of cycles taken.
+using Instruction = uint32_t (*)(CPUState&);
+
+// Instruction handler given its immediate data (the byte or little-endian word after the opcode, ignored by
+// instructions without any) rather than reading it from memory, returns the number of cycles taken.
+using PredecodedInstruction = uint32_t (*)(CPUState&, uint16_t operand);
+
+// Length in bytes of the instruction starting with `opcode`.
+constexpr uint8_t get_instruction_length(uint8_t opcode) {
+  if ((opcode & 0b11001111) == 0x01 || (opcode & 0b11000111) == 0xC2 || (opcode & 0b11000111) == 0xC4
+    || opcode == 0x22 || opcode == 0x2A || opcode == 0x32 || opcode == 0x3A || opcode == 0xC3 || opcode == 0xCD) {
+    return 3;
+  }
+  if ((opcode & 0b11000111) == 0x06 || (opcode & 0b11000111) == 0xC6 || opcode == 0xD3 || opcode == 0xDB) {
+    return 2;
+  }
+  return 1;
+}
+
+// 8080 T-states taken by the instruction starting with `opcode`. Conditional calls and returns take longer when
+// their condition holds, this is the count when it doesn't (see get_taken_instruction_cycles).
+constexpr uint8_t get_instruction_cycles(uint8_t opcode) {
+  const uint8_t ddd = (opcode >> 3) & 0b111;
+  const uint8_t sss = opcode & 0b111;
+
+  if (opcode == 0x76) return 7; // HLT
+  if ((opcode & 0b11000000) == 0x40) return ddd == 0b110 || sss == 0b110 ? 7 : 5; // MOV
+  if ((opcode & 0b11000000) == 0x80) return sss == 0b110 ? 7 : 4; // ALU with register or memory
+  if ((opcode & 0b11000111) == 0x06) return ddd == 0b110 ? 10 : 7; // MVI
+  if ((opcode & 0b11000110) == 0x04) return ddd == 0b110 ? 10 : 5; // INR, DCR
+  if ((opcode & 0b11000111) == 0xC6) return 7; // ALU with immediate
+  if ((opcode & 0b11000111) == 0xC2) return 10; // Jcc
+  if ((opcode & 0b11000111) == 0xC4) return 11; // Ccc
+  if ((opcode & 0b11000111) == 0xC0) return 5; // Rcc
+  if ((opcode & 0b11000111) == 0xC7) return 11; // RST
+
+  switch (opcode & 0b11001111) {
+    case 0x01: return 10; // LXI
+    case 0x03: case 0x0B: return 5; // INX, DCX
+    case 0x09: return 10; // DAD
+    case 0xC5: return 11; // PUSH
+    case 0xC1: return 10; // POP
+  }
+
+  switch (opcode) {
+    case 0x3A: case 0x32: return 13; // LDA, STA
+    case 0x2A: case 0x22: return 16; // LHLD, SHLD
+    case 0x0A: case 0x1A: case 0x02: case 0x12: return 7; // LDAX, STAX
+    case 0xC3: return 10; // JMP
+    case 0xCD: return 17; // CALL
+    case 0xC9: return 10; // RET
+    case 0xE9: case 0xF9: return 5; // PCHL, SPHL
+    case 0xE3: return 18; // XTHL
+    case 0xDB: case 0xD3: return 10; // IN, OUT
+  }
+
+  return 4; // NOP, XCHG, DAA, rotates, CMA, CMC, STC, EI, DI
+}
+
+// T-states taken by a conditional call or return whose condition holds (any other instruction always takes
+// get_instruction_cycles).
+constexpr uint8_t get_taken_instruction_cycles(uint8_t opcode) {
+  if ((opcode & 0b11000111) == 0xC4) return 17;
+  if ((opcode & 0b11000111) == 0xC0) return 11;
+  return get_instruction_cycles(opcode);
+}
+
+// Whether the instruction can continue anywhere but the next instruction (jumps, calls, returns, restarts and halt).
+constexpr bool is_branch(uint8_t opcode) {
+  return opcode == 0xC3 || opcode == 0xCD || opcode == 0xC9 || opcode == 0xE9 || opcode == 0x76
+    || (opcode & 0b11000111) == 0xC2 || (opcode & 0b11000111) == 0xC4
+    || (opcode & 0b11000111) == 0xC0 || (opcode & 0b11000111) == 0xC7;
+}
+
+Instruction get_instruction(uint8_t opcode);
+PredecodedInstruction get_predecoded_instruction(uint8_t opcode);
+bool is_implemented(uint8_t opcode);
+
+// Longest loop body checked for spinning until an interrupt.
+constexpr auto MAX_SPIN_LOOP_LENGTH = 16;
+
+// Whether the straight-line code from `start` up to `end` neither writes memory, the stack or I/O ports nor
+// touches the interrupt state, so that repeating it has no effect the rest of the machine could see.
+bool is_side_effect_free(const uint8_t* ram, uint16_t start, uint16_t end);
+
+// Idioms executed by a single fused handler, see BlockCache::compile.
+enum FusedPattern {
+  FUSED_COPY_LOOP, // LDAX D / MOV M,A / INX H / INX D / DCR B / JNZ start
+  FUSED_FILL_LOOP, // MOV M,A / INX H / DCR B / JNZ start
+  FUSED_PATTERN_COUNT,
+};
+
+constexpr const char* fused_pattern_names[FUSED_PATTERN_COUNT] = { "copy loop", "fill loop" };
+
+// Handler running a whole counted loop of the pattern, starting at cpu.pc. Iterations that don't touch
+// translated code are collapsed into a single bulk memory operation.
+PredecodedInstruction get_fused_instruction(FusedPattern pattern);
+
 void init_cpu_state(CPUState& cpu);
 uint32_t cycle_cpu(CPUState& cpu);
-void interrupt_cpu(CPUState& cpu, uint8_t interrupt);
\ No newline at end of file
+
+// Executes instructions until at least `budget` cycles have been spent or the CPU halts.
+// Returns the number of cycles actually consumed.
+uint32_t run_cycles(CPUState& cpu, uint32_t budget);
+void interrupt_cpu(CPUState& cpu, uint8_t interrupt);
+
+// Brings the flag fields up to date, a no-op unless built with LAZY_FLAGS.
+void materialize_flags(CPUState& cpu);
\ No newline at end of file
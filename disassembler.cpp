@@ -0,0 +1,104 @@
+#include "disassembler.h"
+
+#include <cstdio>
+
+constexpr const char* register_names[8] = { "B", "C", "D", "E", "H", "L", "M", "A" };
+constexpr const char* register_pair_names[4] = { "B", "D", "H", "SP" };
+constexpr const char* condition_names[8] = { "NZ", "Z", "NC", "C", "PO", "PE", "P", "M" };
+constexpr const char* alu_names[8] = { "ADD", "ADC", "SUB", "SBB", "ANA", "XRA", "ORA", "CMP" };
+constexpr const char* alu_immediate_names[8] = { "ADI", "ACI", "SUI", "SBI", "ANI", "XRI", "ORI", "CPI" };
+
+std::string opcode_mnemonic(uint8_t opcode) {
+  const uint8_t ddd = (opcode >> 3) & 0b111;
+  const uint8_t sss = opcode & 0b111;
+  const uint8_t rp = (opcode >> 4) & 0b11;
+
+  if (!is_implemented(opcode)) {
+    return "???";
+  }
+
+  switch (opcode) {
+    case 0x00: return "NOP";
+    case 0x76: return "HLT";
+    case 0x36: return "MVI M";
+    case 0x3A: return "LDA";
+    case 0x32: return "STA";
+    case 0x2A: return "LHLD";
+    case 0x22: return "SHLD";
+    case 0x0A: return "LDAX B";
+    case 0x1A: return "LDAX D";
+    case 0x02: return "STAX B";
+    case 0x12: return "STAX D";
+    case 0xEB: return "XCHG";
+    case 0x27: return "DAA";
+    case 0x07: return "RLC";
+    case 0x0F: return "RRC";
+    case 0x17: return "RAL";
+    case 0x1F: return "RAR";
+    case 0x2F: return "CMA";
+    case 0x3F: return "CMC";
+    case 0x37: return "STC";
+    case 0xC3: return "JMP";
+    case 0xCD: return "CALL";
+    case 0xC9: return "RET";
+    case 0xE9: return "PCHL";
+    case 0xF5: return "PUSH PSW";
+    case 0xF1: return "POP PSW";
+    case 0xE3: return "XTHL";
+    case 0xF9: return "SPHL";
+    case 0xDB: return "IN";
+    case 0xD3: return "OUT";
+    case 0xFB: return "EI";
+    case 0xF3: return "DI";
+  }
+
+  switch (opcode & 0b11000000) {
+    case 0x40:
+      return std::string("MOV ") + register_names[ddd] + "," + register_names[sss];
+    case 0x80:
+      return std::string(alu_names[ddd]) + " " + register_names[sss];
+  }
+
+  switch (opcode & 0b11000111) {
+    case 0x06: return std::string("MVI ") + register_names[ddd];
+    case 0x04: return std::string("INR ") + register_names[ddd];
+    case 0x05: return std::string("DCR ") + register_names[ddd];
+    case 0xC6: return alu_immediate_names[ddd];
+    case 0xC2: return std::string("J") + condition_names[ddd];
+    case 0xC4: return std::string("C") + condition_names[ddd];
+    case 0xC0: return std::string("R") + condition_names[ddd];
+    case 0xC7: return "RST " + std::to_string(ddd);
+  }
+
+  switch (opcode & 0b11001111) {
+    case 0x01: return std::string("LXI ") + register_pair_names[rp];
+    case 0x03: return std::string("INX ") + register_pair_names[rp];
+    case 0x0B: return std::string("DCX ") + register_pair_names[rp];
+    case 0x09: return std::string("DAD ") + register_pair_names[rp];
+    case 0xC5: return std::string("PUSH ") + register_pair_names[rp];
+    case 0xC1: return std::string("POP ") + register_pair_names[rp];
+  }
+
+  return "???";
+}
+
+std::string disassemble(const uint8_t* ram, uint16_t pc) {
+  uint8_t opcode = ram[pc];
+  std::string text = opcode_mnemonic(opcode);
+
+  char operand[8];
+  switch (get_instruction_length(opcode)) {
+    case 2:
+      snprintf(operand, sizeof(operand), "%02Xh", ram[(uint16_t)(pc + 1)]);
+      break;
+    case 3:
+      snprintf(operand, sizeof(operand), "%04Xh", ram[(uint16_t)(pc + 1)] | (ram[(uint16_t)(pc + 2)] << 8));
+      break;
+    default:
+      return text;
+  }
+
+  // Register operands are already part of the mnemonic ("MVI A"), the rest are separated with a space.
+  bool has_register = text.find(' ') != std::string::npos && text.rfind("RST", 0) != 0;
+  return text + (has_register ? "," : " ") + operand;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+#include "cpu.h"
+
+// Mnemonic of an opcode without its operands, e.g. "MOV B,C" or "JNZ".
+std::string opcode_mnemonic(uint8_t opcode);
+
+// Disassembles the instruction at `pc`, e.g. "MVI A,3Fh" or "JNZ 1A2Bh".
+std::string disassemble(const uint8_t* ram, uint16_t pc);
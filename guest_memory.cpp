@@ -0,0 +1,192 @@
+#include "guest_memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+// An unnamed shared-memory object of `size` bytes.
+int create_shared_memory(size_t size) {
+#ifdef __linux__
+  int fd = memfd_create("guest-memory", MFD_CLOEXEC);
+#else
+  // Unlinked right away, the descriptor keeps it alive.
+  static std::atomic<uint64_t> count = 0;
+  const std::string name = "/invaders-" + std::to_string(getpid()) + "-" + std::to_string(count++);
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd >= 0) {
+    shm_unlink(name.c_str());
+  }
+#endif
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    throw std::runtime_error("Error: Could not create guest memory");
+  }
+  return fd;
+}
+
+std::shared_ptr<const MemoryImage> MemoryImage::create(const uint8_t* contents, size_t size) {
+  return create(size, [&](uint8_t* memory) { memcpy(memory, contents, size); });
+}
+
+std::shared_ptr<const MemoryImage> MemoryImage::create(size_t size, const std::function<void(uint8_t*)>& fill) {
+  auto image = std::make_shared<MemoryImage>();
+  image->fd = create_shared_memory(size);
+  image->size = size;
+
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Error: Could not map guest memory");
+  }
+  image->data = (const uint8_t*)memory;
+  fill((uint8_t*)memory);
+  mprotect(memory, size, PROT_READ);
+  return image;
+}
+
+MemoryImage::~MemoryImage() {
+  if (data) {
+    munmap((void*)data, size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+GuestMemory::GuestMemory() : GuestMemory(std::vector<PageSource>()) {}
+
+GuestMemory::GuestMemory(std::shared_ptr<const MemoryImage> image) {
+  if (image->size < GUEST_MEMORY_SIZE) {
+    throw std::runtime_error("Error: Memory image smaller than the guest memory");
+  }
+  reserve();
+  for (size_t page = 0; page < pages.size(); page++) {
+    pages[page] = { image, page * page_size };
+  }
+  map_pages(0, pages.size());
+}
+
+GuestMemory::GuestMemory(std::vector<PageSource> sources) {
+  reserve();
+  if (!sources.empty()) {
+    pages = std::move(sources);
+  }
+  map_pages(0, pages.size());
+}
+
+GuestMemory::GuestMemory(GuestMemory&& other) {
+  *this = std::move(other);
+}
+
+GuestMemory& GuestMemory::operator=(GuestMemory&& other) {
+  if (this != &other) {
+    if (view) {
+      munmap(view, GUEST_MEMORY_SIZE);
+    }
+    view = std::exchange(other.view, nullptr);
+    page_size = other.page_size;
+    pages = std::move(other.pages);
+    cpu = std::exchange(other.cpu, nullptr);
+  }
+  return *this;
+}
+
+GuestMemory::~GuestMemory() {
+  if (view) {
+    munmap(view, GUEST_MEMORY_SIZE);
+  }
+}
+
+void GuestMemory::reserve() {
+  // Hosts with pages larger than the guest memory (none known) get a single page.
+  page_size = std::min<size_t>(sysconf(_SC_PAGESIZE), GUEST_MEMORY_SIZE);
+  pages.assign(GUEST_MEMORY_SIZE / page_size, {});
+
+  void* memory = mmap(nullptr, GUEST_MEMORY_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Error: Could not reserve guest memory");
+  }
+  view = (uint8_t*)memory;
+}
+
+void GuestMemory::map_pages(size_t first, size_t last) {
+  // One mapping per run of pages that are consecutive in the same source.
+  while (first < last) {
+    const PageSource& source = pages[first];
+    size_t end = first + 1;
+    while (end < last && pages[end].image == source.image
+      && (!source.image || pages[end].offset == source.offset + (end - first) * page_size)) {
+      end++;
+    }
+
+    void* address = view + first * page_size;
+    const size_t length = (end - first) * page_size;
+    void* memory = source.image
+      ? mmap(address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, source.image->fd, source.offset)
+      : mmap(address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Error: Could not map guest memory");
+    }
+    first = end;
+  }
+}
+
+bool GuestMemory::is_written(size_t page) const {
+  if (!cpu) {
+    return true;
+  }
+  // A host page holds whole guest pages.
+  const size_t first = page * page_size >> 8, last = (page + 1) * page_size >> 8;
+  return std::any_of(cpu->code_pages + first, cpu->code_pages + last,
+    [](uint8_t flags) { return !(flags & CODE_PAGE_CLEAN); });
+}
+
+size_t GuestMemory::private_pages() const {
+  size_t count = 0;
+  for (size_t page = 0; page < pages.size(); page++) {
+    count += is_written(page);
+  }
+  return count;
+}
+
+GuestMemory GuestMemory::fork() {
+  std::vector<size_t> changed;
+  for (size_t page = 0; page < pages.size(); page++) {
+    if (is_written(page)) {
+      changed.push_back(page);
+    }
+  }
+
+  if (!changed.empty()) {
+    std::vector<uint8_t> contents(changed.size() * page_size);
+    for (size_t i = 0; i < changed.size(); i++) {
+      memcpy(&contents[i * page_size], view + changed[i] * page_size, page_size);
+    }
+    auto image = MemoryImage::create(contents.data(), contents.size());
+
+    // This view drops its private copies and maps the new image too.
+    for (size_t i = 0; i < changed.size(); i++) {
+      pages[changed[i]] = { image, i * page_size };
+      map_pages(changed[i], changed[i] + 1);
+    }
+  }
+  if (cpu) {
+    attach_guest_memory(*cpu, *this);
+  }
+
+  return GuestMemory(pages);
+}
+
+void attach_guest_memory(CPUState& cpu, GuestMemory& memory) {
+  cpu.ram = memory.data();
+  memory.cpu = &cpu;
+  for (uint8_t& flags : cpu.code_pages) {
+    flags |= CODE_PAGE_CLEAN;
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+constexpr size_t GUEST_MEMORY_SIZE = 0x10000;
+
+struct CPUState;
+
+// Immutable memory contents in an anonymous shared-memory object, mapped by any number of GuestMemory views.
+struct MemoryImage {
+  int fd = -1;
+  size_t size = 0;
+  const uint8_t* data = nullptr; // Read-only mapping of the whole image.
+
+  // An image holding a copy of `size` bytes from `contents`.
+  static std::shared_ptr<const MemoryImage> create(const uint8_t* contents, size_t size);
+  // An image of `size` bytes, zeros but for what `fill` writes to it before it becomes read-only.
+  static std::shared_ptr<const MemoryImage> create(size_t size, const std::function<void(uint8_t*)>& fill);
+
+  MemoryImage() = default;
+  MemoryImage(const MemoryImage&) = delete;
+  MemoryImage& operator=(const MemoryImage&) = delete;
+  ~MemoryImage();
+};
+
+// The 64 KB a CPUState addresses, as one contiguous view so that cpu.ram[addr] stays a single load for the
+// interpreter and the code the engines generate.
+//
+// Copy-on-write is left to the host's MMU: every host page of the view is a private mapping of a page of some
+// MemoryImage (or of zeros), so views of the same image share its physical pages until one of them writes to a
+// page, which then gets a private copy. Instances created from one ROM image share it, however many there are.
+//
+// fork() makes a view with the same contents in O(pages written since they were last shared): those pages are
+// copied into a new image, which both views then map. Writes are tracked by the CPU the view is attached to (see
+// attach_guest_memory), without one every page counts as written.
+struct GuestMemory {
+  // Where a page of the view is mapped from, a null image maps zeros.
+  struct PageSource {
+    std::shared_ptr<const MemoryImage> image;
+    size_t offset = 0;
+  };
+
+  uint8_t* view = nullptr;
+  size_t page_size = 0;
+  std::vector<PageSource> pages;
+
+  // Whose code_pages tell the pages written since they were last shared, if attached.
+  CPUState* cpu = nullptr;
+
+  // All zeros.
+  GuestMemory();
+  // The first 64 KB of `image`, which must hold at least that many bytes.
+  explicit GuestMemory(std::shared_ptr<const MemoryImage> image);
+  GuestMemory(GuestMemory&& other);
+  GuestMemory& operator=(GuestMemory&& other);
+  GuestMemory(const GuestMemory&) = delete;
+  GuestMemory& operator=(const GuestMemory&) = delete;
+  ~GuestMemory();
+
+  uint8_t* data() { return view; }
+  const uint8_t* data() const { return view; }
+
+  GuestMemory fork();
+
+  // Pages written since they were last shared, i.e. with a private copy.
+  size_t private_pages() const;
+
+private:
+  explicit GuestMemory(std::vector<PageSource> pages);
+  void reserve();
+  // Maps pages [first, last) from their sources.
+  void map_pages(size_t first, size_t last);
+  bool is_written(size_t page) const;
+};
+
+// Makes `memory` the CPU's memory and tracks its writes: every guest page is flagged CODE_PAGE_CLEAN in code_pages
+// until written, which only costs the first write to each page a trip through the slow path of write_memory. The
+// memory must not have been written since it was last shared.
+void attach_guest_memory(CPUState& cpu, GuestMemory& memory);
@@ -0,0 +1,604 @@
+#include "jit.h"
+
+#include <cstring>
+#include <initializer_list>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+
+// Longest run of instructions translated into a single block.
+constexpr auto JIT_MAX_BLOCK_LENGTH = 64;
+
+// Upper bound of the code emitted for one block.
+constexpr size_t JIT_MAX_TRANSLATION_SIZE = JIT_MAX_BLOCK_LENGTH * 160 + 256;
+
+#if defined(__x86_64__)
+
+// ========================================
+// x86-64 Encoding
+// ========================================
+
+// Encodings of the 8-bit host registers. None of them may be combined with a REX prefix.
+constexpr uint8_t AL = 0, CL = 1, DL = 2, BL = 3, AH = 4, CH = 5, DH = 6, BH = 7;
+
+// Host register pinned to each guest register, indexed by 8080 encoding (6 is the memory operand).
+constexpr uint8_t host_registers[8] = { CH, CL, DH, DL, BH, BL, 0, AL };
+
+// Host register (ecx, edx, ebx) pinned to each guest register pair.
+constexpr uint8_t host_register_pairs[3] = { 1, 2, 3 };
+
+// CPUState fields are addressed as [r12 + disp8].
+constexpr uint8_t field(size_t offset) {
+  return offset;
+}
+
+constexpr uint8_t REGISTERS = field(offsetof(CPUState, registers));
+constexpr uint8_t PC = field(offsetof(CPUState, pc));
+constexpr uint8_t RAM = field(offsetof(CPUState, ram));
+constexpr uint8_t ZERO = field(offsetof(CPUState, zero));
+constexpr uint8_t SIGN = field(offsetof(CPUState, sign));
+constexpr uint8_t PARITY = field(offsetof(CPUState, parity));
+constexpr uint8_t CARRY = field(offsetof(CPUState, carry));
+constexpr uint8_t AUX_CARRY = field(offsetof(CPUState, aux_carry));
+
+static_assert(offsetof(CPUState, ram) < 128, "CPUState fields must be reachable with an 8-bit displacement");
+
+struct Assembler {
+  uint8_t* code;
+  size_t size = 0;
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    for (uint8_t byte : bytes) {
+      code[size++] = byte;
+    }
+  }
+
+  void emit16(uint16_t value) {
+    memcpy(code + size, &value, sizeof(value));
+    size += sizeof(value);
+  }
+
+  void emit32(uint32_t value) {
+    memcpy(code + size, &value, sizeof(value));
+    size += sizeof(value);
+  }
+
+  void emit64(uint64_t value) {
+    memcpy(code + size, &value, sizeof(value));
+    size += sizeof(value);
+  }
+
+  // ModRM/SIB/disp8 for [r12 + offset], the opcode (with REX.B) has to be emitted first.
+  void cpu_field(uint8_t reg, uint8_t offset) {
+    emit({ (uint8_t)(0x44 | reg << 3), 0x24, offset });
+  }
+
+  // ModRM/SIB/disp8 for [rbp + rsi], the guest memory operand.
+  void guest_memory(uint8_t reg) {
+    emit({ (uint8_t)(0x44 | reg << 3), 0x35, 0x00 });
+  }
+};
+
+// ========================================
+// Translation
+// ========================================
+
+struct Translator {
+  Jit& jit;
+  Assembler as;
+
+  // Cycles of the native instructions not yet added to the cycle counter (r13d).
+  uint32_t pending_cycles = 0;
+
+  void prologue() {
+    as.emit({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56 }); // push rbx, rbp, r12, r13, r14
+    as.emit({ 0x49, 0x89, 0xFC });                                // mov r12, rdi
+    as.emit({ 0x49, 0x8B }); as.cpu_field(5, RAM);                // mov rbp, [r12 + ram]
+    as.emit({ 0x45, 0x31, 0xED });                                // xor r13d, r13d
+    load_registers();
+  }
+
+  void epilogue() {
+    as.emit({ 0x44, 0x89, 0xE8 });                                // mov eax, r13d
+    as.emit({ 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B });  // pop r14, r13, r12, rbp, rbx
+    as.emit({ 0xC3 });                                            // ret
+  }
+
+  void load_registers() {
+    as.emit({ 0x41, 0x0F, 0xB7 }); as.cpu_field(1, REGISTERS + 2 * BC_REGISTER); // movzx ecx, word [bc]
+    as.emit({ 0x41, 0x0F, 0xB7 }); as.cpu_field(2, REGISTERS + 2 * DE_REGISTER); // movzx edx, word [de]
+    as.emit({ 0x41, 0x0F, 0xB7 }); as.cpu_field(3, REGISTERS + 2 * HL_REGISTER); // movzx ebx, word [hl]
+    as.emit({ 0x41, 0x8A }); as.cpu_field(AL, REGISTERS + register_index(A_REGISTER)); // mov al, [a]
+  }
+
+  void store_registers() {
+    as.emit({ 0x66, 0x41, 0x89 }); as.cpu_field(1, REGISTERS + 2 * BC_REGISTER); // mov [bc], cx
+    as.emit({ 0x66, 0x41, 0x89 }); as.cpu_field(2, REGISTERS + 2 * DE_REGISTER); // mov [de], dx
+    as.emit({ 0x66, 0x41, 0x89 }); as.cpu_field(3, REGISTERS + 2 * HL_REGISTER); // mov [hl], bx
+    as.emit({ 0x41, 0x88 }); as.cpu_field(AL, REGISTERS + register_index(A_REGISTER)); // mov [a], al
+  }
+
+  void flush_cycles() {
+    if (pending_cycles) {
+      as.emit({ 0x41, 0x81, 0xC5 }); // add r13d, imm32
+      as.emit32(pending_cycles);
+      pending_cycles = 0;
+    }
+  }
+
+  void set_pc(uint16_t pc) {
+    as.emit({ 0x66, 0x41, 0xC7 }); as.cpu_field(0, PC); // mov word [pc], imm16
+    as.emit16(pc);
+  }
+
+  void call(const void* function) {
+    as.emit({ 0x4C, 0x89, 0xE7 }); // mov rdi, r12
+    as.emit({ 0x48, 0xB8 });       // mov rax, imm64
+    as.emit64((uint64_t)function);
+    as.emit({ 0xFF, 0xD0 });       // call rax
+  }
+
+  void exit_block(uint16_t next_pc) {
+    flush_cycles();
+    store_registers();
+    set_pc(next_pc);
+    epilogue();
+  }
+
+  void set_flag(uint8_t condition, uint8_t offset) {
+    as.emit({ 0x41, 0x0F, condition }); as.cpu_field(0, offset); // setcc byte [flag]
+  }
+
+  void clear_flag(uint8_t offset) {
+    as.emit({ 0x41, 0xC6 }); as.cpu_field(0, offset); // mov byte [flag], 0
+    as.emit({ 0x00 });
+  }
+
+  // Zero, sign and parity from the host flags. The 8080 core keeps parity set for an odd number of bits.
+  void set_zsp_flags() {
+    set_flag(0x94, ZERO);   // setz
+    set_flag(0x98, SIGN);   // sets
+    set_flag(0x9B, PARITY); // setnp
+  }
+
+  // Auxiliary carry is bit 4 of the result.
+  void set_aux_carry_flag(uint8_t result_reg) {
+    as.emit({ 0xF6, (uint8_t)(0xC0 | result_reg), 0x10 }); // test reg, 0x10
+    set_flag(0x95, AUX_CARRY);                               // setnz
+  }
+
+  void hl_address() {
+    as.emit({ 0x0F, 0xB7, 0xF3 }); // movzx esi, bx
+  }
+
+  // Calls the interpreter's handler for instructions without a native translation, the `retired`th of the block.
+  void fallback(uint8_t opcode, uint16_t pc, uint8_t retired, bool last) {
+    flush_cycles();
+    store_registers();
+    set_pc(pc);
+    call((const void*)get_instruction(opcode));
+    as.emit({ 0x41, 0x01, 0xC5 }); // add r13d, eax
+#ifdef LAZY_FLAGS
+    // Native instructions read and write the flag fields directly.
+    call((const void*)materialize_flags);
+#endif
+    jit.fallback_instructions++;
+
+    if (last) {
+      epilogue();
+      return;
+    }
+
+    // Leave if the instruction overwrote translated code, cpu.pc already points past it.
+    as.emit({ 0x48, 0xB8 });       // mov rax, imm64
+    as.emit64((uint64_t)&jit.invalidated);
+    as.emit({ 0x80, 0x38, 0x00 }); // cmp byte [rax], 0
+    as.emit({ 0x74, 25 });         // je +25 (past the epilogue)
+    as.emit({ 0x48, 0xB8 });       // mov rax, imm64
+    as.emit64((uint64_t)&jit.exit_instructions);
+    as.emit({ 0xC6, 0x00, retired }); // mov byte [rax], imm8
+    epilogue();
+    load_registers();
+  }
+
+  // Operand kinds of the ALU instructions.
+  enum Operand { REGISTER, MEMORY, IMMEDIATE };
+
+  void alu(uint8_t operation, Operand operand, uint8_t value) {
+    // ADD, SUB, ANA, XRA, ORA and CMP (ADC and SBB fall back to the interpreter).
+    switch (operation) {
+      case 0: // ADD
+        if (operand == REGISTER) as.emit({ 0x00, (uint8_t)(0xC0 | value << 3) }); // add al, reg
+        if (operand == MEMORY) { as.emit({ 0x02 }); as.guest_memory(AL); }      // add al, [rbp + rsi]
+        if (operand == IMMEDIATE) as.emit({ 0x04, value });                       // add al, imm8
+        break;
+      case 2: // SUB, the core adds the negated operand and so sets carry like an addition.
+        if (operand == REGISTER) as.emit({ 0x88, (uint8_t)(0xC4 | value << 3) }); // mov ah, reg
+        if (operand == MEMORY) { as.emit({ 0x8A }); as.guest_memory(AH); }      // mov ah, [rbp + rsi]
+        if (operand == IMMEDIATE) {
+          as.emit({ 0x04, (uint8_t)-value }); // add al, -imm8
+        } else {
+          as.emit({ 0xF6, 0xDC });            // neg ah
+          as.emit({ 0x00, 0xE0 });            // add al, ah
+        }
+        break;
+      case 4: // ANA
+        if (operand == REGISTER) as.emit({ 0x20, (uint8_t)(0xC0 | value << 3) });
+        if (operand == MEMORY) { as.emit({ 0x22 }); as.guest_memory(AL); }
+        if (operand == IMMEDIATE) as.emit({ 0x24, value });
+        break;
+      case 5: // XRA
+        if (operand == REGISTER) as.emit({ 0x30, (uint8_t)(0xC0 | value << 3) });
+        if (operand == MEMORY) { as.emit({ 0x32 }); as.guest_memory(AL); }
+        if (operand == IMMEDIATE) as.emit({ 0x34, value });
+        break;
+      case 6: // ORA
+        if (operand == REGISTER) as.emit({ 0x08, (uint8_t)(0xC0 | value << 3) });
+        if (operand == MEMORY) { as.emit({ 0x0A }); as.guest_memory(AL); }
+        if (operand == IMMEDIATE) as.emit({ 0x0C, value });
+        break;
+      case 7: // CMP, subtracts into ah to keep the result for the auxiliary carry.
+        as.emit({ 0x88, 0xC4 }); // mov ah, al
+        if (operand == REGISTER) as.emit({ 0x28, (uint8_t)(0xC4 | value << 3) }); // sub ah, reg
+        if (operand == MEMORY) { as.emit({ 0x2A }); as.guest_memory(AH); }      // sub ah, [rbp + rsi]
+        if (operand == IMMEDIATE) as.emit({ 0x80, 0xEC, value });                 // sub ah, imm8
+        break;
+    }
+
+    set_zsp_flags();
+    if (operation >= 4 && operation <= 6) {
+      clear_flag(CARRY);
+      clear_flag(AUX_CARRY);
+    } else {
+      set_flag(0x92, CARRY); // setc
+      set_aux_carry_flag(operation == 7 ? AH : AL);
+    }
+  }
+
+  // Emits a native translation, returns false if the instruction has to fall back to the interpreter.
+  bool native(uint8_t opcode, uint16_t pc, CPUState& cpu) {
+    const uint8_t ddd = (opcode >> 3) & 0b111;
+    const uint8_t sss = opcode & 0b111;
+    const uint8_t rp = (opcode >> 4) & 0b11;
+    const uint8_t imm8 = cpu.ram[(uint16_t)(pc + 1)];
+    const uint16_t imm16 = imm8 | (cpu.ram[(uint16_t)(pc + 2)] << 8);
+
+    if (opcode == 0x00) {
+      // NOP
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if ((opcode & 0b11000000) == 0x40 && opcode != 0x76 && ddd != 6) {
+      if (sss == 6) {
+        // MOV r, M
+        hl_address();
+        as.emit({ 0x8A }); as.guest_memory(host_registers[ddd]);
+        pending_cycles += get_instruction_cycles(opcode);
+      } else {
+        // MOV r, r
+        as.emit({ 0x88, (uint8_t)(0xC0 | host_registers[sss] << 3 | host_registers[ddd]) });
+        pending_cycles += get_instruction_cycles(opcode);
+      }
+    } else if ((opcode & 0b11000111) == 0x06 && ddd != 6) {
+      // MVI r
+      as.emit({ (uint8_t)(0xB0 | host_registers[ddd]), imm8 });
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if ((opcode & 0b11001111) == 0x01 && rp != SP_REGISTER) {
+      // LXI rp
+      as.emit({ 0x66, (uint8_t)(0xB8 | host_register_pairs[rp]) });
+      as.emit16(imm16);
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0x3A) {
+      // LDA
+      as.emit({ 0xBE }); // mov esi, imm32
+      as.emit32(imm16);
+      as.emit({ 0x8A }); as.guest_memory(AL);
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0x0A || opcode == 0x1A) {
+      // LDAX B, LDAX D
+      as.emit({ 0x0F, 0xB7, (uint8_t)(0xF0 | host_register_pairs[rp]) }); // movzx esi, cx / dx
+      as.emit({ 0x8A }); as.guest_memory(AL);
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0xEB) {
+      // XCHG
+      as.emit({ 0x87, 0xD3 }); // xchg ebx, edx
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if ((opcode & 0b11001111) == 0x03 && rp != SP_REGISTER) {
+      // INX rp
+      as.emit({ 0x66, 0xFF, (uint8_t)(0xC0 | host_register_pairs[rp]) });
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if ((opcode & 0b11001111) == 0x0B && rp != SP_REGISTER) {
+      // DCX rp
+      as.emit({ 0x66, 0xFF, (uint8_t)(0xC8 | host_register_pairs[rp]) });
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (((opcode & 0b11000111) == 0x04 || (opcode & 0b11000111) == 0x05) && ddd != 6) {
+      // INR r, DCR r (carry is not affected)
+      as.emit({ 0xFE, (uint8_t)((opcode & 1 ? 0xC8 : 0xC0) | host_registers[ddd]) });
+      set_zsp_flags();
+      set_aux_carry_flag(host_registers[ddd]);
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if ((opcode & 0b11000000) == 0x80 && ddd != 1 && ddd != 3) {
+      // ALU r, ALU M
+      if (sss == 6) {
+        hl_address();
+        alu(ddd, MEMORY, 0);
+        pending_cycles += get_instruction_cycles(opcode);
+      } else {
+        alu(ddd, REGISTER, host_registers[sss]);
+        pending_cycles += get_instruction_cycles(opcode);
+      }
+    } else if ((opcode & 0b11000111) == 0xC6 && ddd != 1 && ddd != 3) {
+      // ALU immediate
+      alu(ddd, IMMEDIATE, imm8);
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0x2F) {
+      // CMA
+      as.emit({ 0xF6, 0xD0 }); // not al
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0x37) {
+      // STC
+      as.emit({ 0x41, 0xC6 }); as.cpu_field(0, CARRY);
+      as.emit({ 0x01 });
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0x3F) {
+      // CMC
+      as.emit({ 0x41, 0x80 }); as.cpu_field(6, CARRY); // xor byte [carry], 1
+      as.emit({ 0x01 });
+      pending_cycles += get_instruction_cycles(opcode);
+    } else if (opcode == 0xC3) {
+      // JMP
+      pending_cycles += get_instruction_cycles(opcode);
+      exit_block(imm16);
+    } else if ((opcode & 0b11000111) == 0xC2) {
+      // Jcc, picks the next PC with a conditional move.
+      static constexpr uint8_t condition_fields[4] = { ZERO, CARRY, PARITY, SIGN };
+      pending_cycles += get_instruction_cycles(opcode);
+      flush_cycles();
+      store_registers();
+      as.emit({ 0x41, 0x80 }); as.cpu_field(7, condition_fields[ddd >> 1]); // cmp byte [flag], 0
+      as.emit({ 0x00 });
+      as.emit({ 0xBE }); as.emit32((uint16_t)(pc + 3));                    // mov esi, next
+      as.emit({ 0xBF }); as.emit32(imm16);                                 // mov edi, target
+      as.emit({ 0x0F, (uint8_t)(ddd & 1 ? 0x45 : 0x44), 0xF7 });           // cmovne / cmove esi, edi
+      as.emit({ 0x66, 0x41, 0x89 }); as.cpu_field(6, PC);                  // mov [pc], si
+      epilogue();
+    } else if (opcode == 0xE9) {
+      // PCHL
+      pending_cycles += get_instruction_cycles(opcode);
+      flush_cycles();
+      store_registers();
+      as.emit({ 0x66, 0x41, 0x89 }); as.cpu_field(3, PC); // mov [pc], bx
+      epilogue();
+    } else {
+      return false;
+    }
+
+    jit.native_instructions++;
+    return true;
+  }
+};
+
+bool jit_supported() {
+  return true;
+}
+
+JitCode Jit::translate(CPUState& cpu, uint16_t start_pc) {
+  if (!buffer || !is_implemented(cpu.ram[start_pc])) {
+    return nullptr;
+  }
+  if (JIT_BUFFER_SIZE - used < JIT_MAX_TRANSLATION_SIZE) {
+    flush(cpu);
+  }
+
+  Translator translator { *this, Assembler { buffer + used } };
+  translator.prologue();
+
+  uint16_t pc = start_pc;
+  int count = 0;
+  for (; ; count++) {
+    uint8_t opcode = cpu.ram[pc];
+
+    // Unimplemented opcodes are left to the interpreter to report.
+    if (count == JIT_MAX_BLOCK_LENGTH || !is_implemented(opcode)) {
+      translator.exit_block(pc);
+      break;
+    }
+
+    // Loops that might spin until an interrupt jump through the interpreter, which detects them.
+    bool branch = is_branch(opcode);
+    uint16_t target = cpu.ram[(uint16_t)(pc + 1)] | (cpu.ram[(uint16_t)(pc + 2)] << 8);
+    bool spin_candidate = (opcode == 0xC3 || (opcode & 0b11000111) == 0xC2) && target == start_pc
+      && is_side_effect_free(cpu.ram, start_pc, pc);
+    if (spin_candidate || !translator.native(opcode, pc, cpu)) {
+      translator.fallback(opcode, pc, count + 1, branch);
+    }
+    pc += get_instruction_length(opcode);
+
+    if (branch) {
+      count++;
+      break;
+    }
+  }
+
+  JitCode code = (JitCode)(buffer + used);
+  used += translator.as.size;
+  entries[start_pc] = code;
+  block_instructions[start_pc] = count;
+  blocks_translated++;
+
+  // Register the translation with every page it was decoded from.
+  uint8_t first_page = start_pc >> 8;
+  uint8_t last_page = (uint16_t)(pc - 1) >> 8;
+  for (uint8_t page = first_page; ; page++) {
+    page_blocks[page].push_back(start_pc);
+    cpu.code_pages[page] |= CODE_PAGE_JIT;
+    if (page == last_page) {
+      break;
+    }
+  }
+
+  return code;
+}
+
+#else
+
+bool jit_supported() {
+  return false;
+}
+
+JitCode Jit::translate([[maybe_unused]] CPUState& cpu, [[maybe_unused]] uint16_t pc) {
+  return nullptr;
+}
+
+#endif
+
+Jit::Jit() {
+  if (jit_supported()) {
+    void* memory = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Error: Could not allocate JIT code buffer");
+    }
+    buffer = (uint8_t*)memory;
+  }
+}
+
+Jit::~Jit() {
+  if (buffer) {
+    munmap(buffer, JIT_BUFFER_SIZE);
+  }
+}
+
+void Jit::invalidate_page(CPUState& cpu, uint8_t page) {
+  for (uint16_t start_pc : page_blocks[page]) {
+    if (entries[start_pc]) {
+      entries[start_pc] = nullptr;
+      invalidations++;
+    }
+  }
+  page_blocks[page].clear();
+  cpu.code_pages[page] &= ~CODE_PAGE_JIT;
+  invalidated = true;
+}
+
+void Jit::flush(CPUState& cpu) {
+  for (int page = 0; page < 256; page++) {
+    invalidate_page(cpu, page);
+  }
+  used = 0;
+  flushes++;
+}
+
+void attach_jit(CPUState& cpu, Jit& jit) {
+  cpu.jit = &jit;
+}
+
+// Runs a translated block, then replays it through the interpreter on a copy of the machine and compares.
+uint32_t run_checked(CPUState& cpu, Jit& jit, JitCode code) {
+  CPUState expected = cpu;
+  if (!jit.check_ram) {
+    jit.check_ram = std::make_unique<uint8_t[]>(0x10000);
+  }
+  memcpy(jit.check_ram.get(), cpu.ram, 0x10000);
+  expected.ram = jit.check_ram.get();
+  expected.block_cache = nullptr;
+  expected.jit = nullptr;
+  expected.aot = nullptr;
+  expected.tiers = nullptr;
+  expected.profiler = nullptr;
+  expected.input_latency = nullptr;
+  expected.spin_signature = {};
+  for (uint8_t& flags : expected.code_pages) {
+    flags &= CODE_PAGE_READ_ONLY;
+  }
+
+  uint16_t start_pc = cpu.pc;
+  uint32_t cycles = code(&cpu);
+
+  uint32_t expected_cycles = 0;
+  while (expected_cycles < cycles && !expected.halt) {
+    expected_cycles += cycle_cpu(expected);
+  }
+  materialize_flags(expected);
+
+  std::ostringstream mismatch;
+  auto compare = [&](const char* name, int actual, int reference) {
+    if (actual != reference) {
+      mismatch << " " << name << " (jit 0x" << std::hex << actual << ", interpreter 0x" << reference << std::dec << ")";
+    }
+  };
+  compare("cycles", cycles, expected_cycles);
+  compare("a", cpu.a(), expected.a());
+  compare("b", cpu.b(), expected.b());
+  compare("c", cpu.c(), expected.c());
+  compare("d", cpu.d(), expected.d());
+  compare("e", cpu.e(), expected.e());
+  compare("h", cpu.h(), expected.h());
+  compare("l", cpu.l(), expected.l());
+  compare("pc", cpu.pc, expected.pc);
+  compare("sp", cpu.sp, expected.sp);
+  compare("zero", cpu.zero, expected.zero);
+  compare("sign", cpu.sign, expected.sign);
+  compare("parity", cpu.parity, expected.parity);
+  compare("carry", cpu.carry, expected.carry);
+  compare("aux_carry", cpu.aux_carry, expected.aux_carry);
+  compare("enable_interrupt", cpu.enable_interrupt, expected.enable_interrupt);
+  compare("shift_register", cpu.shift_register, expected.shift_register);
+  compare("shift_offset", cpu.shift_offset, expected.shift_offset);
+  for (int addr = 0; addr < 0x10000; addr++) {
+    if (cpu.ram[addr] != expected.ram[addr]) {
+      mismatch << " ram[0x" << std::hex << addr << std::dec << "]";
+      compare("", cpu.ram[addr], expected.ram[addr]);
+      break;
+    }
+  }
+
+  if (!mismatch.str().empty()) {
+    std::ostringstream error;
+    error << "Error: JIT mismatch in block 0x" << std::hex << start_pc << std::dec << ":" << mismatch.str();
+    throw std::runtime_error(error.str());
+  }
+
+  jit.checked_blocks++;
+  return cycles;
+}
+
+uint32_t run_jit_code(CPUState& cpu, JitCode code) {
+  Jit& jit = *cpu.jit;
+  materialize_flags(cpu);
+  jit.invalidated = false;
+  jit.exit_instructions = 0;
+  jit.executions++;
+  const uint8_t instructions = jit.block_instructions[cpu.pc];
+  uint32_t cycles = jit.cross_check ? run_checked(cpu, jit, code) : code(&cpu);
+  cpu.instructions += jit.exit_instructions ? jit.exit_instructions : instructions;
+  return cycles;
+}
+
+uint32_t run_jit(CPUState& cpu, uint32_t budget) {
+  Jit& jit = *cpu.jit;
+  uint32_t cycles = 0;
+
+  while (cycles < budget && !cpu.halt) {
+    JitCode code = jit.entries[cpu.pc];
+    if (!code) {
+      // Saturating, a counter that wrapped would send hot code back to the interpreter.
+      uint8_t& heat = jit.heat[cpu.pc];
+      heat += heat < JIT_HOT_THRESHOLD;
+      if (heat >= JIT_HOT_THRESHOLD) {
+        code = jit.translate(cpu, cpu.pc);
+      }
+    }
+
+    // Cold code runs through the interpreter up to the next branch.
+    if (!code) {
+      uint8_t opcode;
+      do {
+        opcode = cpu.ram[cpu.pc];
+        cycles += cycle_cpu(cpu);
+      } while (!is_branch(opcode) && cycles < budget);
+      continue;
+    }
+
+    cycles += run_jit_code(cpu, code);
+  }
+
+  return cycles;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+// Executions of a block start address before it gets translated.
+constexpr auto JIT_HOT_THRESHOLD = 16;
+
+// Size of the executable code buffer.
+constexpr size_t JIT_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// Translated block, returns the number of cycles taken with cpu.pc set to the next instruction.
+using JitCode = uint32_t (*)(CPUState*);
+
+// Dynamic recompiler translating hot basic blocks to native x86-64 code.
+//
+// Guest registers are pinned to host registers while a block runs (BC = cx, DE = dx, HL = bx, A = al, which
+// mirrors the 8080 register pairs on the legacy x86 registers) and flags are taken straight from the host
+// EFLAGS. Instructions without a native translation (I/O, stores, calls, returns...) call the interpreter's
+// handler, so memory semantics and invalidation stay shared with it.
+struct Jit {
+  uint8_t* buffer = nullptr;
+  size_t used = 0;
+
+  // Translations keyed by start address.
+  std::array<JitCode, 0x10000> entries {};
+  std::array<uint8_t, 0x10000> heat {}; // Executions before translation, up to JIT_HOT_THRESHOLD.
+  std::array<uint8_t, 0x10000> block_instructions {};
+
+  // Start addresses of the translations overlapping each 256-byte page.
+  std::array<std::vector<uint16_t>, 256> page_blocks;
+
+  // Set when translated code is overwritten, blocks exit after the instruction that did it and store how many
+  // instructions they retired in exit_instructions (left at 0 by blocks that ran to the end).
+  bool invalidated = false;
+  uint8_t exit_instructions = 0;
+
+  // Re-runs every block through the interpreter and compares the resulting state, on a copy of the memory
+  // allocated by the first check.
+  bool cross_check = false;
+  std::unique_ptr<uint8_t[]> check_ram;
+
+  // Statistics
+  uint64_t blocks_translated = 0, native_instructions = 0, fallback_instructions = 0;
+  uint64_t executions = 0, invalidations = 0, flushes = 0, checked_blocks = 0;
+
+  Jit();
+  Jit(const Jit&) = delete;
+  Jit& operator=(const Jit&) = delete;
+  ~Jit();
+
+  // Translates the block at `pc` (flushing the code buffer when full), nullptr if it cannot be translated.
+  JitCode translate(CPUState& cpu, uint16_t pc);
+  void invalidate_page(CPUState& cpu, uint8_t page);
+  void flush(CPUState& cpu);
+};
+
+// Whether native code can be generated on this host.
+bool jit_supported();
+
+// Attaches a JIT to the CPU, writes to translated code then invalidate it.
+void attach_jit(CPUState& cpu, Jit& jit);
+
+// Executes a single translation of the attached JIT.
+uint32_t run_jit_code(CPUState& cpu, JitCode code);
+
+// Same as run_cycles, but executes hot blocks as native code.
+uint32_t run_jit(CPUState& cpu, uint32_t budget);
\ No newline at end of file
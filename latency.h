@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "metrics.h"
+
+// Input-to-photon latency: every change of input port 1 made by the host event loop is timestamped, then followed
+// through the guest reading the port (IN 1), the next conversion of the video RAM after that read and the
+// RenderPresent that shows it. Each stage's latency from the input change is recorded in the metrics histograms.
+//
+// Input changes, conversion and presentation happen on the render thread, reads on the CPU thread. The two only
+// share the timestamps and the counts of changes made and read, published with release/acquire ordering.
+struct InputLatency {
+  // Input changes in flight, older ones are skipped if the guest falls this far behind.
+  static constexpr uint64_t CAPACITY = 256;
+
+  Metrics& metrics;
+
+  // Timestamps of the input changes, indexed by change number modulo CAPACITY.
+  std::array<std::atomic<int64_t>, CAPACITY> changed_ns {};
+  std::atomic<uint64_t> changes = 0;
+  std::atomic<uint64_t> reads = 0;
+
+  // Render thread only: changes converted so far, and the ones in the frame being drawn.
+  uint64_t converted = 0;
+  uint64_t drawing_begin = 0, drawing_end = 0;
+
+  explicit InputLatency(Metrics& metrics) : metrics(metrics) {}
+
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Records the latency of the changes [begin, end) at `now`, skipping the ones overwritten since.
+  void record(Histogram& histogram, uint64_t begin, uint64_t end, int64_t now) {
+    if (end - begin > CAPACITY) {
+      begin = end - CAPACITY;
+    }
+    for (uint64_t change = begin; change < end; change++) {
+      histogram.record((now - changed_ns[change % CAPACITY].load(std::memory_order_relaxed)) / 1000);
+    }
+  }
+
+  // The host changed input port 1.
+  void input_changed() {
+    const uint64_t change = changes.load(std::memory_order_relaxed);
+    changed_ns[change % CAPACITY].store(now_ns(), std::memory_order_relaxed);
+    changes.store(change + 1, std::memory_order_release);
+  }
+
+  // The guest read input port 1, seeing every change made so far.
+  void guest_read() {
+    const uint64_t changed = changes.load(std::memory_order_acquire);
+    const uint64_t read = reads.load(std::memory_order_relaxed);
+    if (changed != read) {
+      record(metrics.input_read_latency_us, read, changed, now_ns());
+      reads.store(changed, std::memory_order_release);
+    }
+  }
+
+  // The video RAM is about to be converted for display, with the effects of every change read so far.
+  void frame_converted() {
+    drawing_begin = converted;
+    drawing_end = converted = reads.load(std::memory_order_acquire);
+    record(metrics.input_convert_latency_us, drawing_begin, drawing_end, now_ns());
+  }
+
+  // RenderPresent returned for the frame last converted.
+  void frame_presented() {
+    record(metrics.input_present_latency_us, drawing_begin, drawing_end, now_ns());
+    drawing_begin = drawing_end;
+  }
+};
@@ -1,14 +1,38 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <map>
 #include <vector>
 #include <chrono>
 #include <thread>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
+#include <csignal>
+#include <random>
+#include <sys/resource.h>
 #include <SDL2/SDL.h>
 
 #include "cpu.h"
-
-constexpr auto SPACE_INVADERS_BIN = "space-invaders/invaders";
+#include "blocks.h"
+#include "jit.h"
+#include "aot.h"
+#include "tiers.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "trace.h"
+#include "metrics.h"
+#include "latency.h"
+#include "batch.h"
+#include "guest_memory.h"
+#include "save_state.h"
+#include "rewind.h"
+#include "run_ahead.h"
+#include "rom.h"
+
+constexpr auto ROM_DIRECTORY = "space-invaders";
 constexpr auto WIDTH = 224 * 2;
 constexpr auto HEIGHT = 256 * 2;
 
@@ -17,66 +41,677 @@ constexpr auto FRAME_BUFFER_WIDTH = 256;
 constexpr auto FRAME_BUFFER_HEIGHT = 224;
 constexpr auto VIDEO_BUFFER_SIZE = VIDEO_RAM_START + (FRAME_BUFFER_WIDTH * FRAME_BUFFER_HEIGHT) / 8;
 
-void load_rom(CPUState& cpu, const std::string& filename) {
-  std::ifstream bin_in(filename, std::ios::binary);
-  if (!bin_in.is_open()) {
-    throw std::runtime_error("Error: Could not open file " + filename);
+void print_fusion_report(const BlockCache& cache, std::ostream& out) {
+  for (int pattern = 0; pattern < FUSED_PATTERN_COUNT; pattern++) {
+    out << "Fused " << fused_pattern_names[pattern]
+      << ": executions: " << cache.fused_executions[pattern]
+      << ", bulk iterations: " << cache.fused_iterations[pattern] << std::endl;
+  }
+}
+
+// Options set from the command line.
+struct EmulatorOptions {
+  bool use_block_cache = false;
+  bool use_jit = false;
+  bool jit_cross_check = false;
+  bool use_aot = false;
+  bool use_tiers = false;
+  TierThresholds tier_thresholds;
+
+  // Profiles every guest instruction, reported on exit and on SIGUSR1.
+  bool profile = false;
+  size_t profile_report_size = 20;
+
+  // Samples the guest call stack every profile_interval cycles into folded stacks written to profile_stacks.
+  std::string profile_stacks;
+  uint32_t profile_interval = 1000;
+  std::string symbols;
+
+  // Chrome trace of the host-side stages, in builds with TRACING.
+  std::string trace;
+
+  // Periodic metrics snapshots, to a JSON or CSV file (by extension) and/or a shared-memory object.
+  std::string metrics_file;
+  std::string metrics_shared_memory;
+  uint32_t metrics_interval_ms = 1000;
+
+  // Runs a fixed number of frames without video or pacing and reports the throughput.
+  bool headless = false;
+  uint64_t headless_frames = 3600;
+  std::string input_script;
+
+  // Runs this many independent headless instances at once, each with its own seed for the default input script.
+  uint32_t batch_instances = 0;
+  BatchOptions batch;
+
+  // Save state restored before the first frame, and written after the last one (optionally compressed).
+  std::string load_state;
+  std::string save_state;
+  bool compress_state = false;
+
+  // Records every frame in a rewind buffer of rewind_buffer_mb megabytes, to step back through while Backspace is
+  // held. Headless runs step back rewind_steps frames after the last one.
+  bool rewind = false;
+  size_t rewind_buffer_mb = 8;
+  uint64_t rewind_steps = 0;
+
+  // Shows the frame this many frames ahead of the machine, emulated with the current input (see RunAhead).
+  uint32_t run_ahead = 0;
+};
+
+EmulatorOptions parse_options(int argc, char* argv[]) {
+  EmulatorOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--blocks") {
+      options.use_block_cache = true;
+    } else if (arg == "--jit") {
+      options.use_jit = true;
+    } else if (arg == "--jit-check") {
+      options.use_jit = true;
+      options.jit_cross_check = true;
+    } else if (arg == "--aot") {
+      options.use_aot = true;
+    } else if (arg == "--tiered") {
+      options.use_tiers = true;
+    } else if (arg.rfind("--tier-blocks=", 0) == 0) {
+      options.use_tiers = true;
+      options.tier_thresholds.blocks = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--tier-native=", 0) == 0) {
+      options.use_tiers = true;
+      options.tier_thresholds.native = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg == "--profile") {
+      options.profile = true;
+    } else if (arg.rfind("--profile-top=", 0) == 0) {
+      options.profile = true;
+      options.profile_report_size = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--profile-stacks=", 0) == 0) {
+      options.profile = true;
+      options.profile_stacks = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--profile-interval=", 0) == 0) {
+      options.profile_interval = std::max(1ul, std::stoul(arg.substr(arg.find('=') + 1)));
+    } else if (arg.rfind("--symbols=", 0) == 0) {
+      options.symbols = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--trace=", 0) == 0) {
+      options.trace = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--metrics=", 0) == 0) {
+      options.metrics_file = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--metrics-shm=", 0) == 0) {
+      options.metrics_shared_memory = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--metrics-interval=", 0) == 0) {
+      options.metrics_interval_ms = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--batch=", 0) == 0) {
+      options.headless = true;
+      options.batch_instances = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--threads=", 0) == 0) {
+      options.batch.threads = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--slice=", 0) == 0) {
+      options.batch.slice_frames = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg == "--pin") {
+      options.batch.pin_threads = true;
+    } else if (arg.rfind("--load-state=", 0) == 0) {
+      options.load_state = arg.substr(arg.find('=') + 1);
+    } else if (arg.rfind("--save-state=", 0) == 0) {
+      options.save_state = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--compress-state") {
+      options.compress_state = true;
+    } else if (arg == "--rewind") {
+      options.rewind = true;
+    } else if (arg.rfind("--rewind-buffer=", 0) == 0) {
+      options.rewind = true;
+      options.rewind_buffer_mb = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--rewind-steps=", 0) == 0) {
+      options.rewind = true;
+      options.rewind_steps = std::stoull(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--run-ahead=", 0) == 0) {
+      options.run_ahead = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg == "--headless") {
+      options.headless = true;
+    } else if (arg.rfind("--frames=", 0) == 0) {
+      options.headless = true;
+      options.headless_frames = std::stoull(arg.substr(arg.find('=') + 1));
+    } else if (arg.rfind("--input=", 0) == 0) {
+      options.headless = true;
+      options.input_script = arg.substr(arg.find('=') + 1);
+    } else {
+      throw std::runtime_error("Error: Unknown option " + arg);
+    }
+  }
+  return options;
+}
+
+// Execution engines selected on the command line, the interpreter runs when none is attached.
+struct Engines {
+  std::unique_ptr<BlockCache> block_cache;
+  std::unique_ptr<Jit> jit;
+  std::unique_ptr<Aot> aot;
+  std::unique_ptr<TieredExecution> tiers;
+  std::unique_ptr<Profiler> profiler;
+};
+
+void attach_engines(CPUState& cpu, const EmulatorOptions& options, Engines& engines) {
+  // Execute through predecoded blocks if requested.
+  if (options.use_block_cache) {
+    engines.block_cache = std::make_unique<BlockCache>();
+    attach_block_cache(cpu, *engines.block_cache);
   }
 
-  // Read binary size.
-  bin_in.seekg(0, std::ios::end);
-  size_t bin_size = bin_in.tellg();
+  // Or translate hot blocks to native code.
+  if (options.use_jit) {
+    if (!jit_supported()) {
+      std::cerr << "Warning: The JIT is not supported on this host, running the interpreter" << std::endl;
+    }
+    engines.jit = std::make_unique<Jit>();
+    engines.jit->cross_check = options.jit_cross_check;
+    attach_jit(cpu, *engines.jit);
+  }
 
-  // Copy binary data to memory.
-  uint8_t* bin_data = new uint8_t[bin_size];
-  bin_in.seekg(0, std::ios::beg);
-  bin_in.read((char*)bin_data, bin_size);
+  // Or run the code translated ahead of time by the recompiler, if it was linked in.
+  if (options.use_aot) {
+    engines.aot = std::make_unique<Aot>();
+    if (!attach_aot(cpu, *engines.aot)) {
+      std::cerr << "Warning: No static translation of the ROM in " << ROM_DIRECTORY
+        << " was linked, running the interpreter" << std::endl;
+      engines.aot.reset();
+    }
+  }
 
-  // Close binary file.
-  bin_in.close();
+  // Or let hot code climb from the interpreter to predecoded blocks and native code.
+  if (options.use_tiers) {
+    engines.tiers = std::make_unique<TieredExecution>(options.tier_thresholds);
+    if (engines.tiers->jit) {
+      engines.tiers->jit->cross_check = options.jit_cross_check;
+    }
+    attach_tiers(cpu, *engines.tiers);
+  }
 
-  // Initialize RAM with the ROM.
-  memset(cpu.ram, 0, 0xFFFF);
-  memcpy(cpu.ram, bin_data, bin_size);
-  delete[] bin_data;
+  // Profiling runs everything through the interpreter, whichever engine is attached.
+  if (options.profile) {
+    engines.profiler = std::make_unique<Profiler>();
+    engines.profiler->report_size = options.profile_report_size;
+    if (!options.profile_stacks.empty()) {
+      engines.profiler->call_stacks = std::make_unique<CallStackSampler>(options.profile_interval);
+      if (!options.symbols.empty()) {
+        engines.profiler->call_stacks->symbols = load_symbols(options.symbols);
+      }
+    }
+    attach_profiler(cpu, *engines.profiler);
+  }
 }
 
-void cpu_loop(CPUState& cpu) {
-  long frame_count = 0;
-  long cycle_count = 0;
-  bool first_interrupt = true;
+void print_engine_stats(const Engines& engines, std::ostream& out) {
+  if (engines.block_cache) {
+    out << "Block cache hits: " << engines.block_cache->hits
+      << ", misses: " << engines.block_cache->misses
+      << ", invalidations: " << engines.block_cache->invalidations << std::endl;
+    print_fusion_report(*engines.block_cache, out);
+  }
 
-  auto last_interrupt_time = std::chrono::high_resolution_clock::now();
-  auto last_cycle_check_time = std::chrono::high_resolution_clock::now();
+  if (engines.jit) {
+    out << "JIT blocks translated: " << engines.jit->blocks_translated
+      << ", executions: " << engines.jit->executions
+      << ", native instructions: " << engines.jit->native_instructions
+      << ", fallback instructions: " << engines.jit->fallback_instructions
+      << ", invalidations: " << engines.jit->invalidations
+      << ", flushes: " << engines.jit->flushes;
+    if (engines.jit->cross_check) {
+      out << ", checked blocks: " << engines.jit->checked_blocks;
+    }
+    out << std::endl;
+  }
 
-  while (true) {
-    const auto now { std::chrono::high_resolution_clock::now() };
+  if (engines.tiers) {
+    for (int tier = 0; tier < TIER_COUNT; tier++) {
+      out << "Tier " << tier_names[tier]
+        << ": executions: " << engines.tiers->stats.executions[tier]
+        << ", promotions: " << engines.tiers->stats.promotions[tier]
+        << ", cycles: " << engines.tiers->cycle_share((Tier)tier) * 100 << "%"
+        << ", time: " << engines.tiers->time_share((Tier)tier) * 100 << "%" << std::endl;
+    }
+    out << "Tier demotions: " << engines.tiers->stats.demotions << std::endl;
+    print_fusion_report(engines.tiers->block_cache, out);
+  }
+
+  if (engines.aot) {
+    out << "AOT block executions: " << engines.aot->executions
+      << ", interpreted instructions: " << engines.aot->interpreted_instructions
+      << ", invalidations: " << engines.aot->invalidations << std::endl;
+  }
+}
+
+void print_rewind_stats(const RewindBuffer& rewind, std::ostream& out) {
+  out << "Rewind frames held: " << rewind.frames()
+    << " (" << (double)rewind.frames() / FRAMES_PER_SECOND << " s)"
+    << ", bytes used: " << rewind.bytes_used() << " of " << rewind.capacity()
+    << ", keyframes: " << rewind.stats.keyframes
+    << ", frames dropped: " << rewind.stats.frames_dropped
+    << ", steps back: " << rewind.stats.steps_back << std::endl;
+}
+
+// Microseconds per frame shown spent running ahead, and spent on snapshots.
+std::pair<double, double> run_ahead_cost_us(const RunAhead& run_ahead) {
+  const auto per_frame = [&](std::chrono::steady_clock::duration time) {
+    const uint64_t frames = std::max<uint64_t>(run_ahead.stats.frames_shown, 1);
+    return std::chrono::duration<double, std::micro>(time).count() / frames;
+  };
+  return { per_frame(run_ahead.stats.ahead_time), per_frame(run_ahead.stats.snapshot_time) };
+}
+
+void print_run_ahead_stats(const RunAhead& run_ahead, std::ostream& out) {
+  const auto [ahead_us, snapshot_us] = run_ahead_cost_us(run_ahead);
+  out << "Run-ahead frames: " << run_ahead.frames
+    << ", frames shown: " << run_ahead.stats.frames_shown
+    << ", frames emulated ahead: " << run_ahead.stats.frames_ahead
+    << ", per frame shown: " << ahead_us << " us ahead + " << snapshot_us << " us snapshots ("
+    << (ahead_us + snapshot_us) * FRAMES_PER_SECOND / 1e4 << "% of the frame time)" << std::endl;
+}
+
+// Set by SIGUSR1, the CPU thread prints the profile between two frames.
+volatile std::sig_atomic_t profile_report_requested = 0;
+
+void request_profile_report(int) {
+  profile_report_requested = 1;
+}
+
+void print_requested_profile(const CPUState& cpu, std::ostream& out) {
+  if (profile_report_requested && cpu.profiler) {
+    profile_report_requested = 0;
+    print_profile(*cpu.profiler, cpu.ram, out);
+  }
+}
+
+// Prints the flat profile and writes the sampled call stacks, if profiling.
+void finish_profile(const CPUState& cpu, const EmulatorOptions& options, std::ostream& out) {
+  if (!cpu.profiler) {
+    return;
+  }
+
+  print_profile(*cpu.profiler, cpu.ram, out);
+  if (cpu.profiler->call_stacks) {
+    std::ofstream stacks_out(options.profile_stacks);
+    if (!stacks_out.is_open()) {
+      throw std::runtime_error("Error: Could not open file " + options.profile_stacks);
+    }
+    write_folded_stacks(*cpu.profiler->call_stacks, stacks_out);
+  }
+}
+
+void configure_metrics_exporter(MetricsExporter& exporter, const EmulatorOptions& options) {
+  const std::string& file = options.metrics_file;
+  if (file.size() >= 4 && file.compare(file.size() - 4, 4, ".csv") == 0) {
+    exporter.csv_file = file;
+  } else {
+    exporter.json_file = file;
+  }
+  exporter.shared_memory_name = options.metrics_shared_memory;
+  exporter.interval = std::chrono::milliseconds(options.metrics_interval_ms);
+  exporter.open();
+}
+
+// Restores the state given with --load-state, if any.
+void restore_state(CPUState& cpu, Scheduler& scheduler, const EmulatorOptions& options) {
+  if (!options.load_state.empty()) {
+    const std::vector<uint8_t> state = read_state_file(options.load_state);
+    load_state(cpu, scheduler, state.data(), state.size());
+  }
+}
+
+// Writes the state to the file given with --save-state, if any.
+void store_state(CPUState& cpu, const Scheduler& scheduler, const EmulatorOptions& options) {
+  if (!options.save_state.empty()) {
+    std::vector<uint8_t> state;
+    save_state(cpu, scheduler, options.compress_state, state);
+    write_state_file(options.save_state, state);
+  }
+}
+
+// Publishes the CPU's totals after a frame that took `frame_time` to emulate.
+void publish_frame_metrics(Metrics& metrics, const CPUState& cpu, const Scheduler& scheduler,
+  std::chrono::steady_clock::duration frame_time) {
+  metrics.cycles.set(scheduler.cycles);
+  metrics.idle_cycles.set(scheduler.idle_cycles);
+  metrics.instructions.set(cpu.instructions);
+  metrics.interrupts_delivered.set(cpu.interrupts_delivered);
+  metrics.interrupts_dropped.set(cpu.interrupts_dropped);
+  metrics.frames_emulated.set(scheduler.frames);
+  metrics.frame_time_us.record(std::chrono::duration_cast<std::chrono::microseconds>(frame_time).count());
+}
+
+void cpu_loop(CPUState& cpu, Scheduler& scheduler, RewindBuffer* rewind, const std::atomic<bool>& rewinding,
+  RunAhead* run_ahead, const std::atomic<bool>& running, Metrics& metrics, MetricsExporter& exporter) {
+  FramePacer pacer;
+  TRACE_THREAD_NAME("cpu");
+
+  while (running) {
+    // Interrupts are timed in emulated cycles, the wall clock only paces whole frames.
+    const auto frame_start = std::chrono::steady_clock::now();
+    if (rewind && rewinding) {
+      TRACE_SCOPE("rewind frame");
+      rewind->step_back(cpu, scheduler);
+    } else {
+      TRACE_SCOPE("emulate frame");
+      run_frame(cpu, scheduler);
+      if (rewind) {
+        rewind->record(cpu, scheduler);
+      }
+    }
+    if (run_ahead) {
+      TRACE_SCOPE("run ahead");
+      run_ahead->present(cpu, scheduler, !(rewind && rewinding));
+    }
+    publish_frame_metrics(metrics, cpu, scheduler, std::chrono::steady_clock::now() - frame_start);
+    exporter.update(metrics);
+    print_requested_profile(cpu, std::cout);
+    {
+      TRACE_SCOPE("pace frame");
+      pacer.wait();
+    }
+  }
+  exporter.update(metrics, true);
+}
+
+// Scripted value of input port 1 from a given frame on.
+struct InputEvent {
+  uint64_t frame;
+  uint8_t port1;
+};
+
+// Inserts a coin, starts a one player game, then sweeps the cannon from side to side while firing. Every sweep
+// lasts 45 frames with seed 0, other seeds pick random sweep lengths.
+std::vector<InputEvent> default_input_script(uint64_t frames, uint32_t seed = 0) {
+  std::vector<InputEvent> script = { {60, 1}, {70, 0}, {120, 1 << 2}, {130, 0} };
+  std::mt19937 random(seed);
+  const auto sweep_length = [&]() -> uint64_t { return seed ? 15 + random() % 60 : 45; };
+  for (uint64_t frame = 180; frame < frames;) {
+    script.push_back({ frame, (1 << 6) | (1 << 4) });
+    frame += sweep_length();
+    script.push_back({ frame, (1 << 5) | (1 << 4) });
+    frame += sweep_length();
+  }
+  return script;
+}
 
-    // Call interrupt every 8ms.
-    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_interrupt_time).count() >= 8) {
-      interrupt_cpu(cpu, first_interrupt ? 1 : 2);
-      first_interrupt = !first_interrupt;
-      last_interrupt_time = now;
+// Reads an input script, one "<frame> <port 1 value>" pair per line sorted by frame, # starts a comment.
+std::vector<InputEvent> load_input_script(const std::string& filename) {
+  std::ifstream script_in(filename);
+  if (!script_in.is_open()) {
+    throw std::runtime_error("Error: Could not open file " + filename);
+  }
+
+  std::vector<InputEvent> script;
+  std::string line;
+  while (std::getline(script_in, line)) {
+    std::istringstream line_in(line.substr(0, line.find('#')));
+    uint64_t frame;
+    unsigned port1;
+    if (line_in >> frame >> std::setbase(0) >> port1) {
+      script.push_back({ frame, (uint8_t)port1 });
     }
+  }
+  return script;
+}
+
+// Peak resident set size of the process in kilobytes.
+long peak_rss_kb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+const char* engine_name(const EmulatorOptions& options) {
+  if (options.use_tiers) return "tiered";
+  if (options.use_aot) return "aot";
+  if (options.use_jit) return "jit";
+  if (options.use_block_cache) return "blocks";
+  return "interpreter";
+}
 
-    // Check cycle count every 1 second.
-    if (std::chrono::duration_cast<std::chrono::seconds>(now - last_cycle_check_time).count() >= 1) {
-      std::cout << "Cycles per second: " << cycle_count << std::endl;
-      cycle_count = 0;
-      last_cycle_check_time = now;
+// Runs the game for a fixed number of frames as fast as possible and prints the throughput as JSON.
+int run_headless(const EmulatorOptions& options) {
+  CPUState cpu;
+  init_cpu_state(cpu);
+  RomLoadStats rom_stats;
+  GuestMemory memory(load_rom(ROM_DIRECTORY, rom_stats));
+  attach_guest_memory(cpu, memory);
+  protect_rom(cpu);
+
+  Engines engines;
+  attach_engines(cpu, options, engines);
+
+  const auto script = options.input_script.empty()
+    ? default_input_script(options.headless_frames)
+    : load_input_script(options.input_script);
+  size_t next_input = 0;
+
+  Scheduler scheduler;
+  restore_state(cpu, scheduler, options);
+  std::unique_ptr<RewindBuffer> rewind;
+  if (options.rewind) {
+    rewind = std::make_unique<RewindBuffer>(options.rewind_buffer_mb << 20);
+  }
+  std::chrono::steady_clock::duration capture_time {}, max_capture_time {};
+  std::unique_ptr<RunAhead> run_ahead;
+  if (options.run_ahead) {
+    run_ahead = std::make_unique<RunAhead>(options.run_ahead);
+  }
+  uint64_t cycles = 0;
+  Metrics metrics;
+  MetricsExporter exporter;
+  configure_metrics_exporter(exporter, options);
+  TRACE_THREAD_NAME("cpu");
+  const auto start = std::chrono::steady_clock::now();
+
+  for (uint64_t frame = 0; frame < options.headless_frames; frame++) {
+    while (next_input < script.size() && script[next_input].frame <= frame) {
+      cpu.input_ports[1] = script[next_input++].port1;
+    }
+    const auto frame_start = std::chrono::steady_clock::now();
+    {
+      TRACE_SCOPE("emulate frame");
+      cycles += run_frame(cpu, scheduler);
+    }
+    if (rewind) {
+      const auto capture_start = std::chrono::steady_clock::now();
+      rewind->record(cpu, scheduler);
+      const auto capture = std::chrono::steady_clock::now() - capture_start;
+      capture_time += capture;
+      max_capture_time = std::max(max_capture_time, capture);
+    }
+    if (run_ahead) {
+      run_ahead->present(cpu, scheduler);
+    }
+    if (exporter.enabled()) {
+      publish_frame_metrics(metrics, cpu, scheduler, std::chrono::steady_clock::now() - frame_start);
+      exporter.update(metrics);
+    }
+    print_requested_profile(cpu, std::cerr);
+  }
 
-      std::cout << "Frames per second: " << frame_count << std::endl;
-      frame_count = 0;
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  exporter.update(metrics, true);
+
+  // Scrubs back through the history, as holding the rewind key would, with the frames held before.
+  const size_t rewind_frames = rewind ? rewind->frames() : 0;
+  uint64_t steps_back = 0;
+  double step_back_seconds = 0;
+  if (rewind) {
+    const auto rewind_start = std::chrono::steady_clock::now();
+    while (steps_back < options.rewind_steps && rewind->step_back(cpu, scheduler)) {
+      steps_back++;
     }
+    step_back_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rewind_start).count();
+  }
+  store_state(cpu, scheduler, options);
+
+  // Checksum of the video RAM, identical across engines when they agree.
+  const uint32_t video_checksum = rom_checksum(cpu.ram + VIDEO_RAM_START, VIDEO_BUFFER_SIZE - VIDEO_RAM_START);
+
+  std::cout << "{\"engine\": \"" << engine_name(options) << "\""
+    << ", \"frames\": " << options.headless_frames
+    << ", \"cycles\": " << cycles
+    << ", \"instructions\": " << cpu.instructions
+    << ", \"seconds\": " << seconds
+    << ", \"emulated_mhz\": " << cycles / seconds / 1e6
+    << ", \"frames_per_second\": " << options.headless_frames / seconds
+    << ", \"ns_per_instruction\": " << (cpu.instructions ? seconds * 1e9 / cpu.instructions : 0)
+    << ", \"peak_rss_kb\": " << peak_rss_kb()
+    << ", \"video_checksum\": " << video_checksum
+    << ",\n \"rom\": {\"source\": \"" << (rom_stats.from_image ? "image" : "parts") << "\""
+    << ", \"unknown_parts\": " << rom_stats.unknown_parts
+    << ", \"load_us\": " << std::chrono::duration<double, std::micro>(rom_stats.time).count()
+    << ", \"discarded_writes\": " << cpu.discarded_writes << "}";
+  if (rewind) {
+    const auto microseconds = [](auto duration) { return std::chrono::duration<double, std::micro>(duration).count(); };
+    std::cout << ",\n \"rewind\": {\"frames\": " << rewind_frames
+      << ", \"history_seconds\": " << (double)rewind_frames / FRAMES_PER_SECOND
+      << ", \"bytes\": " << rewind->bytes_used()
+      << ", \"capacity\": " << rewind->capacity()
+      << ", \"keyframes\": " << rewind->stats.keyframes
+      << ", \"frames_dropped\": " << rewind->stats.frames_dropped
+      << ", \"capture_us\": " << microseconds(capture_time) / options.headless_frames
+      << ", \"max_capture_us\": " << microseconds(max_capture_time)
+      << ", \"steps_back\": " << steps_back
+      << ", \"step_back_us\": " << (steps_back ? step_back_seconds * 1e6 / steps_back : 0) << "}";
+  }
+  if (run_ahead) {
+    // Cost relative to emulating the frames that are kept, and to the time a frame is shown for.
+    const auto [ahead_us, snapshot_us] = run_ahead_cost_us(*run_ahead);
+    const double extra_seconds = (ahead_us + snapshot_us) * options.headless_frames / 1e6;
+    std::cout << ",\n \"run_ahead\": {\"frames\": " << run_ahead->frames
+      << ", \"frames_emulated_ahead\": " << run_ahead->stats.frames_ahead
+      << ", \"ahead_us\": " << ahead_us
+      << ", \"snapshot_us\": " << snapshot_us
+      << ", \"extra_cpu\": " << extra_seconds / std::max(seconds - extra_seconds, 1e-9)
+      << ", \"frame_time_share\": " << (ahead_us + snapshot_us) * FRAMES_PER_SECOND / 1e6
+      << ", \"video_checksum_shown\": "
+      << rom_checksum(run_ahead->display.data() + VIDEO_RAM_START, VIDEO_BUFFER_SIZE - VIDEO_RAM_START) << "}";
+  }
+  std::cout << "}" << std::endl;
+
+  print_engine_stats(engines, std::cerr);
+  finish_profile(cpu, options, std::cerr);
+  if (!options.trace.empty()) {
+    write_trace(options.trace);
+  }
+  return 0;
+}
+
+// Runs options.batch_instances headless instances on a BatchRunner and prints their throughput and results as JSON.
+int run_batch(const EmulatorOptions& options) {
+  // Profiling and metrics are per process, instances only get the execution engines.
+  EmulatorOptions instance_options = options;
+  instance_options.profile = false;
+
+  if (!options.save_state.empty()) {
+    std::cerr << "Warning: Batch instances don't write save states" << std::endl;
+  }
+
+  // Every instance maps the same image, the ROM is shared (see GuestMemory).
+  RomLoadStats rom_stats;
+  const auto rom = load_rom(ROM_DIRECTORY, rom_stats);
+
+  BatchRunner runner(options.batch);
+  std::vector<Engines> engines(options.batch_instances);
+  std::vector<std::vector<InputEvent>> scripts(options.batch_instances);
+
+  for (uint32_t i = 0; i < options.batch_instances; i++) {
+    BatchInstance& instance = runner.add_instance(options.headless_frames);
+    init_cpu_state(instance.cpu);
+    instance.memory = GuestMemory(rom);
+    attach_guest_memory(instance.cpu, instance.memory);
+    protect_rom(instance.cpu);
+    restore_state(instance.cpu, instance.scheduler, options);
+    attach_engines(instance.cpu, instance_options, engines[i]);
+
+    scripts[i] = options.input_script.empty()
+      ? default_input_script(options.headless_frames, i)
+      : load_input_script(options.input_script);
+    instance.before_frame = [script = &scripts[i], next_input = (size_t)0](BatchInstance& instance, uint64_t frame)
+      mutable {
+      while (next_input < script->size() && (*script)[next_input].frame <= frame) {
+        instance.cpu.input_ports[1] = (*script)[next_input++].port1;
+      }
+    };
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  runner.run();
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t cycles = 0, instructions = 0, frames = 0, steals = 0;
+  for (const auto& instance : runner.instances) {
+    cycles += instance->cycles;
+    instructions += instance->cpu.instructions;
+    frames += instance->frames_run;
+  }
+  for (const BatchWorkerStats& stats : runner.worker_stats) {
+    steals += stats.steals;
+  }
 
-    cycle_count += cycle_cpu(cpu);
-    if (cpu.halt) {
-      break;
+  std::cout << "{\"engine\": \"" << engine_name(options) << "\""
+    << ", \"instances\": " << runner.instances.size()
+    << ", \"threads\": " << runner.worker_stats.size()
+    << ", \"frames\": " << frames
+    << ", \"cycles\": " << cycles
+    << ", \"instructions\": " << instructions
+    << ", \"seconds\": " << seconds
+    << ", \"emulated_mhz\": " << cycles / seconds / 1e6
+    << ", \"frames_per_second\": " << frames / seconds
+    << ", \"ns_per_instruction\": " << (instructions ? seconds * 1e9 / instructions : 0)
+    << ", \"steals\": " << steals
+    << ", \"peak_rss_kb\": " << peak_rss_kb()
+    << ",\n \"results\": [";
+
+  int failed = 0;
+  for (size_t i = 0; i < runner.instances.size(); i++) {
+    const BatchInstance& instance = *runner.instances[i];
+    std::cout << (i ? ",\n  " : "\n  ")
+      << "{\"instance\": " << i
+      << ", \"frames\": " << instance.frames_run
+      << ", \"cycles\": " << instance.cycles
+      << ", \"instructions\": " << instance.cpu.instructions
+      << ", \"host_seconds\": " << instance.host_seconds
+      << ", \"slices\": " << instance.slices
+      << ", \"migrations\": " << instance.migrations
+      << ", \"video_checksum\": "
+      << rom_checksum(instance.cpu.ram + VIDEO_RAM_START, VIDEO_BUFFER_SIZE - VIDEO_RAM_START);
+    if (instance.error) {
+      failed++;
+      try {
+        std::rethrow_exception(instance.error);
+      } catch (const std::exception& error) {
+        std::cout << ", \"error\": \"" << error.what() << "\"";
+      }
     }
+    std::cout << "}";
   }
+  std::cout << "\n ]}" << std::endl;
+
+  return failed ? 1 : 0;
 }
 
 int main(int argc, char* argv[]) {
+  EmulatorOptions options = parse_options(argc, argv);
+  if (options.profile) {
+    std::signal(SIGUSR1, request_profile_report);
+  }
+  if (!options.trace.empty()) {
+    if (!TRACING_COMPILED) {
+      std::cerr << "Warning: Built without -DTRACING, no trace will be written" << std::endl;
+    }
+    start_tracing();
+  }
+  if (options.batch_instances) {
+    return run_batch(options);
+  }
+  if (options.headless) {
+    return run_headless(options);
+  }
+
   // Initialize SDL.
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     std::cerr << "Error: Could not initialize SDL" << std::endl;
@@ -118,10 +753,46 @@ int main(int argc, char* argv[]) {
   init_cpu_state(cpu);
 
   // Load Space Invaders ROM.
-  load_rom(cpu, SPACE_INVADERS_BIN);
+  RomLoadStats rom_stats;
+  GuestMemory memory(load_rom(ROM_DIRECTORY, rom_stats));
+  attach_guest_memory(cpu, memory);
+  protect_rom(cpu);
+
+  // Attach the execution engines selected on the command line.
+  Engines engines;
+  attach_engines(cpu, options, engines);
+
+  // Metrics shared by both threads, exported by the CPU thread.
+  Metrics metrics;
+  MetricsExporter exporter;
+  configure_metrics_exporter(exporter, options);
+
+  // Follow input changes to the screen.
+  InputLatency input_latency(metrics);
+  cpu.input_latency = &input_latency;
+
+  // Resume from a save state if requested.
+  Scheduler scheduler;
+  restore_state(cpu, scheduler, options);
+
+  // History to step back through while Backspace is held.
+  std::unique_ptr<RewindBuffer> rewind;
+  if (options.rewind) {
+    rewind = std::make_unique<RewindBuffer>(options.rewind_buffer_mb << 20);
+  }
+  std::atomic<bool> rewinding = false;
+
+  // Frames are shown from the run-ahead's copy of the video RAM if it is enabled.
+  std::unique_ptr<RunAhead> run_ahead;
+  if (options.run_ahead) {
+    run_ahead = std::make_unique<RunAhead>(options.run_ahead);
+  }
+  const uint8_t* video_memory = run_ahead ? run_ahead->display.data() : cpu.ram;
 
   // Start CPU loop.
-  std::thread cpu_thread(cpu_loop, std::ref(cpu));
+  std::atomic<bool> running = true;
+  std::thread cpu_thread(cpu_loop, std::ref(cpu), std::ref(scheduler), rewind.get(), std::cref(rewinding),
+    run_ahead.get(), std::cref(running), std::ref(metrics), std::ref(exporter));
 
   // Bitmask for each input.
   std::map<uint8_t, uint8_t> input_map = {
@@ -141,6 +812,8 @@ int main(int argc, char* argv[]) {
   // Variables for the frame rate.
   auto last_render_time =  std::chrono::high_resolution_clock::now();
 
+  TRACE_THREAD_NAME("render");
+
   while (true) {
     const auto now { std::chrono::high_resolution_clock::now() };
 
@@ -152,48 +825,92 @@ int main(int argc, char* argv[]) {
       else if (e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE)
         break;
 
+      if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && e.key.keysym.sym == SDLK_BACKSPACE) {
+        rewinding = e.type == SDL_KEYDOWN;
+      }
+
       if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
         auto input_mask = input_map.find(e.key.keysym.sym);
         if (input_mask != input_map.end()) {
-          cpu.input_ports[1] = e.type == SDL_KEYDOWN 
+          uint8_t port1 = e.type == SDL_KEYDOWN 
             ? cpu.input_ports[1] | input_mask->second
             : cpu.input_ports[1] & ~input_mask->second;
+          if (port1 != cpu.input_ports[1]) {
+            cpu.input_ports[1] = port1;
+            input_latency.input_changed();
+          }
         }
       }
     }
 
     // Render only every 16ms.
     if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_render_time).count() < 16) {
+      metrics.render_spins.add();
       continue;
     }
+    last_render_time = now;
 
     // Update frame buffer.
-    for (int i = VIDEO_RAM_START; i < VIDEO_BUFFER_SIZE; i++) {
-      uint8_t video_byte = cpu.ram[i];
-      int byte_index = i - VIDEO_RAM_START;
-      for (int j = 0; j < 8; j++) {
-        frame_buffer[byte_index * 8 + j] = (video_byte & (1 << j)) != 0 
-          ? 0xFF000000 
-          : 0x00000000;
+    {
+      TRACE_SCOPE("convert frame buffer");
+      input_latency.frame_converted();
+      for (int i = VIDEO_RAM_START; i < VIDEO_BUFFER_SIZE; i++) {
+        uint8_t video_byte = video_memory[i];
+        int byte_index = i - VIDEO_RAM_START;
+        for (int j = 0; j < 8; j++) {
+          frame_buffer[byte_index * 8 + j] = (video_byte & (1 << j)) != 0 
+            ? 0xFF000000 
+            : 0x00000000;
+        }
       }
     }
 
     // Update frame buffer texture.
-    SDL_UpdateTexture(frame_buffer_texture, NULL, frame_buffer, FRAME_BUFFER_WIDTH * sizeof(uint32_t));
+    {
+      TRACE_SCOPE("SDL_UpdateTexture");
+      SDL_UpdateTexture(frame_buffer_texture, NULL, frame_buffer, FRAME_BUFFER_WIDTH * sizeof(uint32_t));
+    }
 
     // Clear the screen.
-    SDL_RenderClear(renderer);
+    {
+      TRACE_SCOPE("SDL_RenderClear");
+      SDL_RenderClear(renderer);
+    }
 
     // Copy the texture to the rendering context.
-    SDL_RenderCopyEx(renderer, frame_buffer_texture, NULL, &dest, 270, NULL, SDL_FLIP_NONE);
+    {
+      TRACE_SCOPE("SDL_RenderCopyEx");
+      SDL_RenderCopyEx(renderer, frame_buffer_texture, NULL, &dest, 270, NULL, SDL_FLIP_NONE);
+    }
 
     // Present the image.
-    SDL_RenderPresent(renderer);
+    {
+      TRACE_SCOPE("SDL_RenderPresent");
+      SDL_RenderPresent(renderer);
+    }
+    input_latency.frame_presented();
+
+    metrics.frames_rendered.add();
+    metrics.render_time_us.record(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::high_resolution_clock::now() - now).count());
   }
 
   // Wait for CPU thread to finish.
-  cpu.halt = true;
+  running = false;
   cpu_thread.join();
+  store_state(cpu, scheduler, options);
+
+  print_engine_stats(engines, std::cout);
+  if (rewind) {
+    print_rewind_stats(*rewind, std::cout);
+  }
+  if (run_ahead) {
+    print_run_ahead_stats(*run_ahead, std::cout);
+  }
+  finish_profile(cpu, options, std::cout);
+  if (!options.trace.empty()) {
+    write_trace(options.trace);
+  }
 
   SDL_DestroyTexture(frame_buffer_texture);
   SDL_DestroyRenderer(renderer);
@@ -1,6 +1,9 @@
 #!/bin/bash
-g++ cpu.cpp main.cpp -o emulator -std=c++20 -g \
+g++ cpu.cpp blocks.cpp jit.cpp aot.cpp tiers.cpp scheduler.cpp profiler.cpp disassembler.cpp trace.cpp metrics.cpp guest_memory.cpp rom.cpp save_state.cpp rewind.cpp run_ahead.cpp batch.cpp main.cpp -o emulator -std=c++20 -g "$@" \
   -L/opt/homebrew/Cellar/sdl2/2.28.5/lib \
   -lSDL2 \
   -I/opt/homebrew/Cellar/sdl2/2.28.5/include \
   -I/opt/homebrew/Cellar/sdl2/2.28.5/include/SDL2
+
+# Opcode microbenchmarks for the same build.
+g++ cpu.cpp blocks.cpp jit.cpp aot.cpp tiers.cpp scheduler.cpp profiler.cpp disassembler.cpp guest_memory.cpp save_state.cpp benchmark.cpp -o benchmark -std=c++20 -g "$@"
@@ -0,0 +1,2 @@
+#!/bin/bash
+g++ cpu.cpp blocks.cpp jit.cpp aot.cpp tiers.cpp profiler.cpp disassembler.cpp recompiler.cpp -o recompiler -std=c++20 "$@"
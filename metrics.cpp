@@ -0,0 +1,190 @@
+#include "metrics.h"
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+  const uint64_t rank = (uint64_t)(q * count);
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += buckets[bucket];
+    if (seen > rank) {
+      return bucket ? (1ull << bucket) - 1 : 0;
+    }
+  }
+  return count ? (1ull << (HISTOGRAM_BUCKETS - 1)) - 1 : 0;
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+  HistogramSnapshot snapshot;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    snapshot.buckets[bucket] = buckets[bucket].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.buckets[bucket];
+  }
+  snapshot.sum = sum.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+  MetricsSnapshot snapshot;
+  snapshot.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  snapshot.cycles = cycles.get();
+  snapshot.idle_cycles = idle_cycles.get();
+  snapshot.instructions = instructions.get();
+  snapshot.interrupts_delivered = interrupts_delivered.get();
+  snapshot.interrupts_dropped = interrupts_dropped.get();
+  snapshot.frames_emulated = frames_emulated.get();
+  snapshot.frames_rendered = frames_rendered.get();
+  snapshot.render_spins = render_spins.get();
+  snapshot.frame_time_us = frame_time_us.snapshot();
+  snapshot.render_time_us = render_time_us.snapshot();
+  snapshot.input_read_latency_us = input_read_latency_us.snapshot();
+  snapshot.input_convert_latency_us = input_convert_latency_us.snapshot();
+  snapshot.input_present_latency_us = input_present_latency_us.snapshot();
+  return snapshot;
+}
+
+MetricsExporter::~MetricsExporter() {
+  if (shared) {
+    munmap(shared, sizeof(SharedMetrics));
+    shm_unlink(shared_memory_name.c_str());
+  }
+}
+
+void MetricsExporter::open() {
+  if (!json_file.empty()) {
+    const std::string temporary = json_file + ".tmp";
+    if (!std::ofstream(temporary).is_open()) {
+      throw std::runtime_error("Error: Could not open file " + temporary);
+    }
+    std::remove(temporary.c_str());
+  }
+
+  if (!csv_file.empty()) {
+    std::ofstream out(csv_file, std::ios::trunc);
+    out << "seconds,cycles,idle_cycles,instructions,interrupts_delivered,interrupts_dropped,frames_emulated,"
+      << "frames_rendered,render_spins,frame_time_us_mean,frame_time_us_p99,render_time_us_mean,render_time_us_p99,"
+      << "input_read_latency_us_mean,input_present_latency_us_mean,input_present_latency_us_p99"
+      << std::endl;
+    if (!out) {
+      throw std::runtime_error("Error: Could not write file " + csv_file);
+    }
+  }
+
+  if (!shared_memory_name.empty() && !shared) {
+    int fd = shm_open(shared_memory_name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(SharedMetrics)) < 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error("Error: Could not create shared memory " + shared_memory_name);
+    }
+    void* memory = mmap(nullptr, sizeof(SharedMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Error: Could not map shared memory " + shared_memory_name);
+    }
+    shared = new (memory) SharedMetrics { SharedMetrics::VERSION, sizeof(SharedMetrics), 0, {} };
+  }
+}
+
+// Stops exporting to `file` after a failed write, it runs on the CPU thread and mustn't stop the emulation.
+static void disable_export(std::string& file) {
+  std::cerr << "Warning: Could not write metrics to " << file << ", no longer exporting them there" << std::endl;
+  file.clear();
+}
+
+void MetricsExporter::update(const Metrics& metrics, bool force) {
+  const auto now = std::chrono::steady_clock::now();
+  if (!enabled() || (!force && now - last_export < interval)) {
+    return;
+  }
+  last_export = now;
+
+  const MetricsSnapshot snapshot = metrics.snapshot();
+  if (!json_file.empty() && !write_json(snapshot)) {
+    disable_export(json_file);
+  }
+  if (!csv_file.empty() && !write_csv(snapshot)) {
+    disable_export(csv_file);
+  }
+  if (shared) {
+    write_shared_memory(snapshot);
+  }
+}
+
+static void write_json_histogram(std::ostream& out, const HistogramSnapshot& histogram) {
+  out << "{\"count\": " << histogram.count
+    << ", \"mean\": " << histogram.mean()
+    << ", \"p50\": " << histogram.quantile(0.5)
+    << ", \"p90\": " << histogram.quantile(0.9)
+    << ", \"p99\": " << histogram.quantile(0.99)
+    << ", \"buckets\": [";
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    out << (bucket ? ", " : "") << histogram.buckets[bucket];
+  }
+  out << "]}";
+}
+
+bool MetricsExporter::write_json(const MetricsSnapshot& snapshot) {
+  // Written next to the file and renamed over it, so readers never see a partial snapshot.
+  const std::string temporary = json_file + ".tmp";
+  std::ofstream out(temporary);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  out << "{\"seconds\": " << snapshot.seconds
+    << ", \"cycles\": " << snapshot.cycles
+    << ", \"idle_cycles\": " << snapshot.idle_cycles
+    << ", \"instructions\": " << snapshot.instructions
+    << ", \"interrupts_delivered\": " << snapshot.interrupts_delivered
+    << ", \"interrupts_dropped\": " << snapshot.interrupts_dropped
+    << ", \"frames_emulated\": " << snapshot.frames_emulated
+    << ", \"frames_rendered\": " << snapshot.frames_rendered
+    << ", \"render_spins\": " << snapshot.render_spins
+    << ",\n \"frame_time_us\": ";
+  write_json_histogram(out, snapshot.frame_time_us);
+  out << ",\n \"render_time_us\": ";
+  write_json_histogram(out, snapshot.render_time_us);
+  out << ",\n \"input_read_latency_us\": ";
+  write_json_histogram(out, snapshot.input_read_latency_us);
+  out << ",\n \"input_convert_latency_us\": ";
+  write_json_histogram(out, snapshot.input_convert_latency_us);
+  out << ",\n \"input_present_latency_us\": ";
+  write_json_histogram(out, snapshot.input_present_latency_us);
+  out << "}" << std::endl;
+  out.close();
+
+  return !out.fail() && std::rename(temporary.c_str(), json_file.c_str()) == 0;
+}
+
+bool MetricsExporter::write_csv(const MetricsSnapshot& snapshot) {
+  std::ofstream out(csv_file, std::ios::app);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  out << snapshot.seconds << ',' << snapshot.cycles << ',' << snapshot.idle_cycles << ',' << snapshot.instructions
+    << ',' << snapshot.interrupts_delivered << ',' << snapshot.interrupts_dropped << ',' << snapshot.frames_emulated
+    << ',' << snapshot.frames_rendered << ',' << snapshot.render_spins
+    << ',' << snapshot.frame_time_us.mean() << ',' << snapshot.frame_time_us.quantile(0.99)
+    << ',' << snapshot.render_time_us.mean() << ',' << snapshot.render_time_us.quantile(0.99)
+    << ',' << snapshot.input_read_latency_us.mean() << ',' << snapshot.input_present_latency_us.mean()
+    << ',' << snapshot.input_present_latency_us.quantile(0.99) << std::endl;
+  return !out.fail();
+}
+
+void MetricsExporter::write_shared_memory(const MetricsSnapshot& snapshot) {
+  shared->sequence.fetch_add(1, std::memory_order_acq_rel);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&shared->snapshot, &snapshot, sizeof(snapshot));
+  shared->sequence.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Runtime metrics shared by the CPU and render threads. Updates are relaxed atomic operations on separate cache
+// lines, readers get a snapshot that is consistent per value, not across values.
+
+// Histogram buckets, bucket i counts the values in [2^(i-1), 2^i), bucket 0 counts zeros.
+constexpr auto HISTOGRAM_BUCKETS = 32;
+
+struct alignas(64) Counter {
+  std::atomic<uint64_t> value = 0;
+
+  void add(uint64_t amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+  // For totals kept by a single thread, which publishes them as they change.
+  void set(uint64_t total) { value.store(total, std::memory_order_relaxed); }
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct HistogramSnapshot {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+
+  double mean() const { return count ? (double)sum / count : 0; }
+  // Upper bound of the bucket holding the given quantile (0 to 1).
+  uint64_t quantile(double q) const;
+};
+
+struct alignas(64) Histogram {
+  std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> buckets {};
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> sum = 0;
+
+  void record(uint64_t value) {
+    const size_t bucket = std::min<size_t>(std::bit_width(value), HISTOGRAM_BUCKETS - 1);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  HistogramSnapshot snapshot() const;
+};
+
+// Plain copy of the registry, also the layout of the shared-memory page (see MetricsExporter).
+struct MetricsSnapshot {
+  double seconds = 0; // Since the registry was created.
+  uint64_t cycles = 0;
+  uint64_t idle_cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t interrupts_delivered = 0;
+  uint64_t interrupts_dropped = 0; // Raised while interrupts were disabled.
+  uint64_t frames_emulated = 0;
+  uint64_t frames_rendered = 0;
+  uint64_t render_spins = 0; // Render loop iterations that had nothing to draw yet.
+  HistogramSnapshot frame_time_us; // Host time emulating a frame.
+  HistogramSnapshot render_time_us; // Host time drawing a frame, from the video RAM to RenderPresent.
+
+  // Time from an input change to the guest reading it, to the video RAM being converted after that read, and to
+  // that frame being presented (see InputLatency).
+  HistogramSnapshot input_read_latency_us;
+  HistogramSnapshot input_convert_latency_us;
+  HistogramSnapshot input_present_latency_us;
+};
+
+struct Metrics {
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  // Published by the CPU thread after every frame.
+  Counter cycles, idle_cycles, instructions, interrupts_delivered, interrupts_dropped, frames_emulated;
+  Histogram frame_time_us;
+
+  // Updated by the render thread.
+  Counter frames_rendered, render_spins;
+  Histogram render_time_us;
+
+  // Updated by InputLatency, from both threads.
+  Histogram input_read_latency_us, input_convert_latency_us, input_present_latency_us;
+
+  MetricsSnapshot snapshot() const;
+};
+
+// Writes snapshots of the registry every `interval`: over a JSON file (the latest snapshot), appended to a CSV file
+// (one row per snapshot), or into a POSIX shared-memory object other processes can map.
+//
+// The shared-memory object holds a SharedMetrics. Its sequence number is odd while a snapshot is being written,
+// readers copy the snapshot and retry if the sequence changed or was odd.
+struct SharedMetrics {
+  static constexpr uint32_t VERSION = 1;
+
+  uint32_t version;
+  uint32_t size; // sizeof(SharedMetrics)
+  std::atomic<uint64_t> sequence;
+  MetricsSnapshot snapshot;
+};
+
+struct MetricsExporter {
+  std::string json_file, csv_file, shared_memory_name;
+  std::chrono::milliseconds interval { 1000 };
+
+  MetricsExporter() = default;
+  ~MetricsExporter();
+  MetricsExporter(const MetricsExporter&) = delete;
+  MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+  bool enabled() const { return !json_file.empty() || !csv_file.empty() || !shared_memory_name.empty(); }
+
+  // Creates the configured targets, throws if one of them can't be written. Called once configured, before the
+  // first update.
+  void open();
+
+  // Exports a snapshot if the interval has elapsed since the last one, or right away if `force` is set. Never throws,
+  // a file that can no longer be written gets a warning and isn't exported to anymore.
+  void update(const Metrics& metrics, bool force = false);
+
+private:
+  std::chrono::steady_clock::time_point last_export {};
+  SharedMetrics* shared = nullptr;
+
+  bool write_json(const MetricsSnapshot& snapshot);
+  bool write_csv(const MetricsSnapshot& snapshot);
+  void write_shared_memory(const MetricsSnapshot& snapshot);
+};
@@ -0,0 +1,160 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "disassembler.h"
+
+void attach_profiler(CPUState& cpu, Profiler& profiler) {
+  cpu.profiler = &profiler;
+}
+
+void CallStackSampler::enter(uint16_t target, uint16_t sp, bool interrupt) {
+  // Frames whose return address just got overwritten can't be returned from anymore.
+  while (!frames.empty() && frames.back().sp <= sp) {
+    frames.pop_back();
+  }
+  frames.push_back({ target, sp, interrupt });
+}
+
+void CallStackSampler::leave(uint16_t sp) {
+  while (!frames.empty() && frames.back().sp <= sp) {
+    frames.pop_back();
+  }
+}
+
+void CallStackSampler::record(const CPUState& cpu, uint8_t opcode, uint16_t sp, uint32_t cycles) {
+  // Conditional calls and returns only move SP when taken.
+  if (cpu.sp != sp) {
+    const bool is_call = opcode == 0xCD || (opcode & 0b11000111) == 0xC4 || (opcode & 0b11000111) == 0xC7;
+    const bool is_return = opcode == 0xC9 || (opcode & 0b11000111) == 0xC0;
+    if (is_call) {
+      enter(cpu.pc, cpu.sp, false);
+    } else if (is_return) {
+      leave(sp);
+    }
+  }
+
+  cycles_until_sample -= cycles;
+  while (cycles_until_sample <= 0) {
+    sample();
+    cycles_until_sample += interval;
+  }
+}
+
+void CallStackSampler::sample() {
+  std::vector<uint32_t> stack;
+  stack.reserve(std::min(frames.size(), MAX_DEPTH));
+  for (size_t i = 0; i < frames.size() && i < MAX_DEPTH; i++) {
+    stack.push_back(frames[i].target | (frames[i].interrupt ? 1 << 16 : 0));
+  }
+  samples[stack]++;
+}
+
+uint32_t run_profiled(CPUState& cpu, uint32_t budget) {
+  uint32_t cycles = 0;
+  while (cycles < budget && !cpu.halt) {
+    cycles += cycle_cpu(cpu);
+  }
+  return cycles;
+}
+
+// Indices of the `count` largest non-zero entries of `cycles`, largest first.
+template <size_t N>
+static std::vector<size_t> hottest(const std::array<uint64_t, N>& cycles, size_t count) {
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < N; i++) {
+    if (cycles[i]) {
+      indices.push_back(i);
+    }
+  }
+  count = std::min(count, indices.size());
+  std::partial_sort(indices.begin(), indices.begin() + count, indices.end(),
+    [&](size_t a, size_t b) { return cycles[a] > cycles[b]; });
+  indices.resize(count);
+  return indices;
+}
+
+void print_profile(const Profiler& profiler, const uint8_t* ram, std::ostream& out) {
+  const uint64_t total_cycles = std::accumulate(profiler.opcode_cycles.begin(), profiler.opcode_cycles.end(), 0ull);
+  const uint64_t total_executions =
+    std::accumulate(profiler.opcode_executions.begin(), profiler.opcode_executions.end(), 0ull);
+  if (!total_cycles) {
+    out << "Profile: no instructions executed" << std::endl;
+    return;
+  }
+
+  const auto share = [&](uint64_t cycles) { return 100.0 * cycles / total_cycles; };
+  const auto flags = out.flags();
+  out << std::fixed << std::setprecision(2);
+
+  out << "Profile: " << total_executions << " instructions, " << total_cycles << " cycles" << std::endl;
+
+  out << "Hot addresses:" << std::endl;
+  for (size_t pc : hottest(profiler.pc_cycles, profiler.report_size)) {
+    out << "  " << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << pc
+      << std::dec << std::nouppercase << std::setfill(' ')
+      << "  " << std::setw(6) << share(profiler.pc_cycles[pc]) << "%"
+      << "  cycles: " << std::setw(12) << profiler.pc_cycles[pc]
+      << "  executions: " << std::setw(12) << profiler.pc_executions[pc]
+      << "  " << disassemble(ram, pc) << std::endl;
+  }
+
+  out << "Hot opcodes:" << std::endl;
+  for (size_t opcode : hottest(profiler.opcode_cycles, profiler.report_size)) {
+    out << "  " << std::left << std::setw(8) << opcode_mnemonic(opcode) << std::right
+      << "  " << std::setw(6) << share(profiler.opcode_cycles[opcode]) << "%"
+      << "  cycles: " << std::setw(12) << profiler.opcode_cycles[opcode]
+      << "  executions: " << std::setw(12) << profiler.opcode_executions[opcode] << std::endl;
+  }
+
+  out.flags(flags);
+}
+
+std::unordered_map<uint16_t, std::string> load_symbols(const std::string& filename) {
+  std::ifstream symbols_in(filename);
+  if (!symbols_in.is_open()) {
+    throw std::runtime_error("Error: Could not open file " + filename);
+  }
+
+  std::unordered_map<uint16_t, std::string> symbols;
+  std::string line;
+  while (std::getline(symbols_in, line)) {
+    std::istringstream line_in(line.substr(0, line.find('#')));
+    std::string address, name;
+    if (line_in >> address >> name) {
+      symbols[std::stoul(address, nullptr, 16)] = name;
+    }
+  }
+  return symbols;
+}
+
+static std::string frame_name(const CallStackSampler& sampler, uint32_t frame) {
+  const uint16_t address = frame & 0xFFFF;
+  auto symbol = sampler.symbols.find(address);
+  if (symbol != sampler.symbols.end()) {
+    return symbol->second;
+  }
+
+  char name[16];
+  snprintf(name, sizeof(name), "%s_%04X", frame >> 16 ? "irq" : "sub", address);
+  return name;
+}
+
+void write_folded_stacks(const CallStackSampler& sampler, std::ostream& out) {
+  const std::string root = frame_name(sampler, 0x0000);
+  for (const auto& [stack, count] : sampler.samples) {
+    out << root;
+    for (uint32_t frame : stack) {
+      out << ';' << frame_name(sampler, frame);
+    }
+    out << ' ' << count << '\n';
+  }
+  out.flush();
+}
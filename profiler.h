@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu.h"
+
+// Subroutine entered by a call, restart or interrupt, with the stack pointer just after its return address was
+// pushed.
+struct CallFrame {
+  uint16_t target;
+  uint16_t sp;
+  bool interrupt;
+};
+
+// Shadow of the guest call stack, sampled every `interval` emulated cycles into folded stacks.
+//
+// Frames are matched to returns by stack pointer rather than strictly nested: a return pops every frame whose
+// return address is at or below the one it returns through, and a call drops the frames it overwrites, so code
+// that discards return addresses or resets SP doesn't leave stale frames behind.
+struct CallStackSampler {
+  // Deeper frames are still matched against returns but only the outermost ones are sampled.
+  static constexpr size_t MAX_DEPTH = 64;
+
+  uint32_t interval;
+  int64_t cycles_until_sample;
+  std::vector<CallFrame> frames;
+
+  // Sample counts keyed by the entry addresses on the stack, outermost first, interrupt entries with bit 16 set.
+  std::map<std::vector<uint32_t>, uint64_t> samples;
+
+  // Names of subroutine entry addresses, see load_symbols.
+  std::unordered_map<uint16_t, std::string> symbols;
+
+  explicit CallStackSampler(uint32_t interval) : interval(interval), cycles_until_sample(interval) {}
+
+  void enter(uint16_t target, uint16_t sp, bool interrupt);
+  void leave(uint16_t sp);
+
+  // Tracks the calls and returns of an instruction that took `cycles` and moved SP from `sp`, sampling as
+  // intervals elapse.
+  void record(const CPUState& cpu, uint8_t opcode, uint16_t sp, uint32_t cycles);
+  void sample();
+};
+
+// Execution counts and cycles of every guest instruction, by address and by opcode.
+//
+// Recording happens in cycle_cpu, which costs a single predictable branch while no profiler is attached. With one
+// attached the CPU runs through run_profiled, so every instruction goes through cycle_cpu whatever execution
+// engine was selected.
+struct Profiler {
+  std::array<uint64_t, 0x10000> pc_executions {};
+  std::array<uint64_t, 0x10000> pc_cycles {};
+  std::array<uint64_t, 256> opcode_executions {};
+  std::array<uint64_t, 256> opcode_cycles {};
+
+  // Entries listed in each section of the report.
+  size_t report_size = 20;
+
+  // Sampled call stacks, if requested.
+  std::unique_ptr<CallStackSampler> call_stacks;
+
+  // Records the instruction at `pc` that ran with SP at `sp`.
+  void record(const CPUState& cpu, uint16_t pc, uint16_t sp, uint8_t opcode, uint32_t cycles) {
+    pc_executions[pc]++;
+    pc_cycles[pc] += cycles;
+    opcode_executions[opcode]++;
+    opcode_cycles[opcode] += cycles;
+    if (call_stacks) {
+      call_stacks->record(cpu, opcode, sp, cycles);
+    }
+  }
+
+  // Records an interrupt accepted by the CPU, after it pushed the return address.
+  void record_interrupt(const CPUState& cpu) {
+    if (call_stacks) {
+      call_stacks->enter(cpu.pc, cpu.sp, true);
+    }
+  }
+};
+
+void attach_profiler(CPUState& cpu, Profiler& profiler);
+
+// Same as run_cycles, but records every instruction in the attached profiler.
+uint32_t run_profiled(CPUState& cpu, uint32_t budget);
+
+// Reads a symbol file, one "<hex address> <name>" pair per line, # starts a comment.
+std::unordered_map<uint16_t, std::string> load_symbols(const std::string& filename);
+
+// Writes one line per sampled call stack, "outer;inner count", as read by flame graph tools. Subroutines are named
+// from the symbol file, or sub_XXXX (irq_XXXX for interrupt handlers) and the code outside any call after address 0.
+void write_folded_stacks(const CallStackSampler& sampler, std::ostream& out);
+
+// Prints the hottest addresses (disassembled from `ram`) and opcodes by cycles, with their share of the total.
+void print_profile(const Profiler& profiler, const uint8_t* ram, std::ostream& out);
@@ -0,0 +1,380 @@
+// Static recompiler, translates the code reachable in a ROM image to C++ ahead of time.
+//
+// Code is discovered by walking the control flow from the reset and interrupt vectors (0x00, 0x08 and 0x10),
+// following jumps, calls and restarts. Every discovered basic block becomes one C++ function operating on
+// CPUState, registered with the emulator through aot.h when the generated file is linked in. Computed jumps
+// (PCHL) and returns cannot be followed statically, their targets are found when they are also reached some
+// other way and interpreted otherwise.
+//
+// Usage: recompiler <rom> <output.cpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "cpu.h"
+#include "aot.h"
+#include "disassembler.h"
+
+// Longest run of instructions translated into a single function.
+constexpr auto MAX_AOT_BLOCK_LENGTH = 256;
+
+constexpr const char* register_accessors[8] = {
+  "cpu.b()", "cpu.c()", "cpu.d()", "cpu.e()", "cpu.h()", "cpu.l()", nullptr, "cpu.a()"
+};
+constexpr const char* register_pair_names[4] = { "BC_REGISTER", "DE_REGISTER", "HL_REGISTER", "SP_REGISTER" };
+constexpr const char* condition_tests[8] = {
+  "!cpu.zero", "cpu.zero", "!cpu.carry", "cpu.carry", "!cpu.parity", "cpu.parity", "!cpu.sign", "cpu.sign"
+};
+
+constexpr auto HL_ADDRESS = "cpu.get_register_pair_value(HL_REGISTER)";
+
+struct Rom {
+  std::string name;
+  std::vector<uint8_t> image;
+  uint8_t ram[0x10000] = {};
+
+  bool contains(uint32_t addr, uint32_t length) const {
+    return addr + length <= image.size();
+  }
+};
+
+std::string hex(uint32_t value, int digits = 4) {
+  char text[16];
+  snprintf(text, sizeof(text), "0x%0*X", digits, value);
+  return text;
+}
+
+// `text` as a C++ string literal, quotes, backslashes and control characters escaped.
+std::string string_literal(const std::string& text) {
+  std::string literal = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      literal += '\\';
+      literal += c;
+    } else if (c < 0x20 || c == 0x7F) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\%03o", c);
+      literal += escape;
+    } else {
+      literal += c;
+    }
+  }
+  return literal + "\"";
+}
+
+// Finds the start of every basic block reachable from the vectors.
+std::set<uint16_t> find_leaders(const Rom& rom) {
+  std::set<uint16_t> leaders;
+  std::vector<uint16_t> pending = { 0x00, 0x08, 0x10 };
+
+  auto add = [&](uint16_t addr) {
+    if (rom.contains(addr, 1) && leaders.insert(addr).second) {
+      pending.push_back(addr);
+    }
+  };
+
+  std::erase_if(pending, [&](uint16_t vector) { return !rom.contains(vector, 1); });
+  leaders.insert(pending.begin(), pending.end());
+
+  while (!pending.empty()) {
+    uint16_t pc = pending.back();
+    pending.pop_back();
+
+    // Follow the straight-line code until it leaves for somewhere else.
+    while (true) {
+      uint8_t opcode = rom.ram[pc];
+      uint8_t length = get_instruction_length(opcode);
+      if (!is_implemented(opcode) || !rom.contains(pc, length)) {
+        break;
+      }
+
+      uint16_t next = pc + length;
+      uint16_t target = rom.ram[(uint16_t)(pc + 1)] | (rom.ram[(uint16_t)(pc + 2)] << 8);
+      if (opcode == 0xC3) {
+        add(target);
+        break;
+      } else if ((opcode & 0b11000111) == 0xC2 || (opcode & 0b11000111) == 0xC4 || opcode == 0xCD) {
+        add(target);
+        add(next);
+        break;
+      } else if ((opcode & 0b11000111) == 0xC7) {
+        add(opcode & 0b00111000);
+        add(next);
+        break;
+      } else if ((opcode & 0b11000111) == 0xC0 || opcode == 0x76) {
+        add(next);
+        break;
+      } else if (opcode == 0xC9 || opcode == 0xE9) {
+        break;
+      }
+      pc = next;
+    }
+  }
+
+  return leaders;
+}
+
+// Emits the C++ statements for the instruction at `pc`, the `retired`th of its block. Returns false if the block ends
+// with it.
+bool emit_instruction(std::ostream& out, const Rom& rom, uint16_t pc, int retired) {
+  const uint8_t opcode = rom.ram[pc];
+  const uint8_t length = get_instruction_length(opcode);
+  const uint8_t ddd = (opcode >> 3) & 0b111;
+  const uint8_t sss = opcode & 0b111;
+  const uint8_t rp = (opcode >> 4) & 0b11;
+  const uint8_t imm8 = rom.ram[(uint16_t)(pc + 1)];
+  const uint16_t imm16 = imm8 | (rom.ram[(uint16_t)(pc + 2)] << 8);
+  const uint16_t next = pc + length;
+  const int cycles = get_instruction_cycles(opcode);
+  const int taken_cycles = get_taken_instruction_cycles(opcode);
+
+  // Stores can overwrite translated code, in which case the rest of the block must not run.
+  auto check_invalidated = [&]() {
+    out << "  if (cpu.aot->invalidated) { cpu.aot->exit_instructions = " << retired << "; cpu.pc = " << hex(next)
+      << "; return cycles; }\n";
+  };
+
+  out << "  // " << hex(pc, 4).substr(2) << ": " << disassemble(rom.ram, pc) << "\n";
+
+  // Loops that might spin until an interrupt jump through the interpreter, which detects them.
+  bool spin_candidate = (opcode == 0xC3 || (opcode & 0b11000111) == 0xC2) && imm16 <= pc
+    && is_side_effect_free(rom.ram, imm16, pc);
+
+  if (spin_candidate) {
+    out << "  cpu.pc = " << hex(pc) << ";\n";
+    out << "  return cycles + get_instruction(" << hex(opcode, 2) << ")(cpu);\n";
+    return false;
+  } else if (opcode == 0x00) {
+    out << "  cycles += " << cycles << ";\n";
+  } else if ((opcode & 0b11000000) == 0x40 && opcode != 0x76) {
+    if (ddd == 0b110) {
+      out << "  cpu.write_memory(" << HL_ADDRESS << ", " << register_accessors[sss] << ");\n";
+      out << "  cycles += " << cycles << ";\n";
+      check_invalidated();
+    } else if (sss == 0b110) {
+      out << "  " << register_accessors[ddd] << " = cpu.ram[" << HL_ADDRESS << "];\n";
+      out << "  cycles += " << cycles << ";\n";
+    } else {
+      out << "  " << register_accessors[ddd] << " = " << register_accessors[sss] << ";\n";
+      out << "  cycles += " << cycles << ";\n";
+    }
+  } else if ((opcode & 0b11000111) == 0x06) {
+    if (ddd == 0b110) {
+      out << "  cpu.write_memory(" << HL_ADDRESS << ", " << hex(imm8, 2) << ");\n";
+      out << "  cycles += " << cycles << ";\n";
+      check_invalidated();
+    } else {
+      out << "  " << register_accessors[ddd] << " = " << hex(imm8, 2) << ";\n";
+      out << "  cycles += " << cycles << ";\n";
+    }
+  } else if ((opcode & 0b11001111) == 0x01) {
+    out << "  cpu.set_register_pair_value(" << register_pair_names[rp] << ", " << hex(imm16) << ");\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if ((opcode & 0b11001111) == 0x03 || (opcode & 0b11001111) == 0x0B) {
+    const char* step = (opcode & 0b1000) ? " - 1" : " + 1";
+    out << "  cpu.set_register_pair_value(" << register_pair_names[rp] << ", cpu.get_register_pair_value("
+      << register_pair_names[rp] << ")" << step << ");\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0x3A) {
+    out << "  cpu.a() = cpu.ram[" << hex(imm16) << "];\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0x32) {
+    out << "  cpu.write_memory(" << hex(imm16) << ", cpu.a());\n";
+    out << "  cycles += " << cycles << ";\n";
+    check_invalidated();
+  } else if (opcode == 0x2A) {
+    out << "  cpu.l() = cpu.ram[" << hex(imm16) << "];\n";
+    out << "  cpu.h() = cpu.ram[" << hex((uint16_t)(imm16 + 1)) << "];\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0x22) {
+    out << "  cpu.write_memory(" << hex(imm16) << ", cpu.l());\n";
+    out << "  cpu.write_memory(" << hex((uint16_t)(imm16 + 1)) << ", cpu.h());\n";
+    out << "  cycles += " << cycles << ";\n";
+    check_invalidated();
+  } else if (opcode == 0x0A || opcode == 0x1A) {
+    out << "  cpu.a() = cpu.ram[cpu.get_register_pair_value(" << register_pair_names[rp] << ")];\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0x02 || opcode == 0x12) {
+    out << "  cpu.write_memory(cpu.get_register_pair_value(" << register_pair_names[rp] << "), cpu.a());\n";
+    out << "  cycles += " << cycles << ";\n";
+    check_invalidated();
+  } else if (opcode == 0xEB) {
+    out << "  std::swap(cpu.register_pairs[DE_REGISTER], cpu.register_pairs[HL_REGISTER]);\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if ((opcode & 0b11001111) == 0xC5 && rp != 0b11) {
+    out << "  cpu.push_stack(cpu.get_register_pair_value(" << register_pair_names[rp] << "));\n";
+    out << "  cycles += " << cycles << ";\n";
+    check_invalidated();
+  } else if ((opcode & 0b11001111) == 0xC1 && rp != 0b11) {
+    out << "  cpu.set_register_pair_value(" << register_pair_names[rp] << ", cpu.pop_stack());\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0xF9) {
+    out << "  cpu.sp = " << HL_ADDRESS << ";\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0x2F) {
+    out << "  cpu.a() = ~cpu.a();\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0xFB || opcode == 0xF3) {
+    out << "  cpu.enable_interrupt = " << (opcode == 0xFB ? "true" : "false") << ";\n";
+    out << "  cycles += " << cycles << ";\n";
+  } else if (opcode == 0xC3) {
+    out << "  cpu.pc = " << hex(imm16) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if ((opcode & 0b11000111) == 0xC2) {
+    out << "  materialize_flags(cpu);\n";
+    out << "  cpu.pc = " << condition_tests[ddd] << " ? " << hex(imm16) << " : " << hex(next) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if (opcode == 0xCD) {
+    out << "  cpu.push_stack(" << hex(next) << ");\n";
+    out << "  cpu.pc = " << hex(imm16) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if ((opcode & 0b11000111) == 0xC4) {
+    out << "  materialize_flags(cpu);\n";
+    out << "  if (" << condition_tests[ddd] << ") {\n";
+    out << "    cpu.push_stack(" << hex(next) << ");\n";
+    out << "    cpu.pc = " << hex(imm16) << ";\n";
+    out << "    return cycles + " << taken_cycles << ";\n";
+    out << "  }\n";
+    out << "  cpu.pc = " << hex(next) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if (opcode == 0xC9) {
+    out << "  cpu.pc = cpu.pop_stack();\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if ((opcode & 0b11000111) == 0xC0) {
+    out << "  materialize_flags(cpu);\n";
+    out << "  if (" << condition_tests[ddd] << ") {\n";
+    out << "    cpu.pc = cpu.pop_stack();\n";
+    out << "    return cycles + " << taken_cycles << ";\n";
+    out << "  }\n";
+    out << "  cpu.pc = " << hex(next) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if ((opcode & 0b11000111) == 0xC7) {
+    out << "  cpu.push_stack(" << hex(next) << ");\n";
+    out << "  cpu.pc = " << hex(opcode & 0b00111000) << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else if (opcode == 0xE9) {
+    out << "  cpu.pc = " << HL_ADDRESS << ";\n";
+    out << "  return cycles + " << cycles << ";\n";
+    return false;
+  } else {
+    // Everything touching flags, I/O or the machine state runs through the interpreter's handler.
+    out << "  cpu.pc = " << hex(pc) << ";\n";
+    if (is_branch(opcode)) {
+      out << "  return cycles + get_instruction(" << hex(opcode, 2) << ")(cpu);\n";
+      return false;
+    }
+    out << "  cycles += get_instruction(" << hex(opcode, 2) << ")(cpu);\n";
+    if (opcode == 0x34 || opcode == 0x35 || opcode == 0xE3 || opcode == 0xF5) {
+      check_invalidated();
+    }
+  }
+
+  return true;
+}
+
+// Emits the function for the block starting at `start_pc`, returns the PC after its last instruction.
+uint16_t emit_block(std::ostream& out, const Rom& rom, const std::set<uint16_t>& leaders, uint16_t start_pc,
+  int& instructions) {
+  out << "uint32_t block_" << hex(start_pc).substr(2) << "(CPUState& cpu) {\n";
+  out << "  uint32_t cycles = 0;\n";
+
+  uint16_t pc = start_pc;
+  for (int count = 0; ; count++) {
+    uint8_t opcode = rom.ram[pc];
+    uint8_t length = get_instruction_length(opcode);
+
+    // Continue through the next block (or the interpreter) from the dispatch loop.
+    bool next_is_leader = count > 0 && leaders.count(pc);
+    if (next_is_leader || count == MAX_AOT_BLOCK_LENGTH || !is_implemented(opcode) || !rom.contains(pc, length)) {
+      out << "  cpu.pc = " << hex(pc) << ";\n";
+      out << "  return cycles;\n";
+      break;
+    }
+
+    bool continues = emit_instruction(out, rom, pc, count + 1);
+    instructions = count + 1;
+    pc += length;
+    if (!continues) {
+      break;
+    }
+  }
+
+  out << "}\n\n";
+  return pc;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <rom> <output.cpp>" << std::endl;
+    return 1;
+  }
+
+  Rom rom;
+  rom.name = argv[1];
+  std::ifstream rom_in(rom.name, std::ios::binary);
+  if (!rom_in.is_open()) {
+    std::cerr << "Error: Could not open file " << rom.name << std::endl;
+    return 1;
+  }
+  rom.image.assign(std::istreambuf_iterator<char>(rom_in), std::istreambuf_iterator<char>());
+  if (rom.image.empty() || rom.image.size() > 0x10000) {
+    std::cerr << "Error: " << rom.name << " is not a valid ROM image" << std::endl;
+    return 1;
+  }
+  std::copy(rom.image.begin(), rom.image.end(), rom.ram);
+
+  std::set<uint16_t> leaders = find_leaders(rom);
+
+  std::ostringstream blocks;
+  std::vector<std::tuple<uint16_t, uint16_t, int>> ranges;
+  for (uint16_t start_pc : leaders) {
+    if (!is_implemented(rom.ram[start_pc])) {
+      continue;
+    }
+    int instructions = 0;
+    uint16_t end_pc = emit_block(blocks, rom, leaders, start_pc, instructions);
+    ranges.emplace_back(start_pc, end_pc, instructions);
+  }
+
+  std::ofstream out(argv[2]);
+  if (!out.is_open()) {
+    std::cerr << "Error: Could not open file " << argv[2] << std::endl;
+    return 1;
+  }
+
+  // Escaped in the comment too, a newline in the name would end it.
+  out << "// Generated by recompiler from " << string_literal(rom.name) << ", do not edit.\n\n";
+  out << "#include \"aot.h\"\n\n";
+  out << "namespace {\n\n";
+  out << blocks.str();
+  out << "const AotBlock blocks[] = {\n";
+  for (auto [start_pc, end_pc, instructions] : ranges) {
+    out << "  { " << hex(start_pc) << ", " << hex(end_pc) << ", " << instructions << ", block_"
+      << hex(start_pc).substr(2) << " },\n";
+  }
+  out << "};\n\n";
+  out << "const AotTranslation translation {\n";
+  out << "  " << string_literal(rom.name) << ", " << hex(rom.image.size()) << ", "
+    << hex(rom_checksum(rom.image.data(), rom.image.size()), 8) << ", blocks, " << ranges.size() << "\n";
+  out << "};\n\n";
+  out << "const bool registered = register_aot_translation(translation);\n\n";
+  out << "}\n";
+
+  std::cout << "Translated " << ranges.size() << " blocks from " << rom.name << " to " << argv[2] << std::endl;
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include "rewind.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Largest encoded frame: a snapshot and incompressible memory.
+constexpr size_t MAX_FRAME_SIZE = sizeof(MachineSnapshot) + rle_max_size(GAME_RAM_SIZE);
+
+// out = a ^ b, a word at a time: byte loops over pointers that may alias aren't vectorized.
+void xor_memory(uint8_t* out, const uint8_t* a, const uint8_t* b, size_t size) {
+  for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    x ^= y;
+    memcpy(out + i, &x, sizeof(x));
+  }
+}
+
+RewindBuffer::RewindBuffer(size_t capacity, uint32_t keyframe_interval)
+  : ring(std::max(capacity, 4 * MAX_FRAME_SIZE)), keyframe_interval(std::max(1u, keyframe_interval)),
+    keyframe_memory(GAME_RAM_SIZE), encoded(MAX_FRAME_SIZE), scratch(MAX_FRAME_SIZE), delta(GAME_RAM_SIZE) {}
+
+size_t RewindBuffer::encode(CPUState& cpu, const Scheduler& scheduler, bool keyframe) {
+  MachineSnapshot machine;
+  capture_machine(cpu, scheduler, machine);
+  memcpy(encoded.data(), &machine, sizeof(machine));
+
+  const uint8_t* memory = cpu.ram + GAME_RAM_START;
+  if (keyframe) {
+    return sizeof(machine) + rle_compress(memory, GAME_RAM_SIZE, encoded.data() + sizeof(machine));
+  }
+  xor_memory(delta.data(), memory, keyframe_memory.data(), GAME_RAM_SIZE);
+  return sizeof(machine) + rle_compress(delta.data(), GAME_RAM_SIZE, encoded.data() + sizeof(machine));
+}
+
+void RewindBuffer::record(CPUState& cpu, const Scheduler& scheduler) {
+  bool keyframe = entries.empty() || entries.back().keyframe_distance + 1 >= keyframe_interval;
+  size_t size = encode(cpu, scheduler, keyframe);
+
+  while (used + size > capacity()) {
+    // Making room would drop this frame's own keyframe, start a new one instead.
+    if (!keyframe && entries.size() == entries.back().keyframe_distance + 1) {
+      keyframe = true;
+      size = encode(cpu, scheduler, keyframe);
+      continue;
+    }
+    drop_oldest();
+  }
+
+  const size_t first = std::min(size, capacity() - head);
+  memcpy(&ring[head], encoded.data(), first);
+  memcpy(&ring[0], encoded.data() + first, size - first);
+
+  const Entry entry { head, (uint32_t)size, keyframe ? 0 : entries.back().keyframe_distance + 1, next_serial++ };
+  entries.push_back(entry);
+  head = (head + size) % capacity();
+  used += size;
+
+  if (keyframe) {
+    memcpy(keyframe_memory.data(), cpu.ram + GAME_RAM_START, GAME_RAM_SIZE);
+    keyframe_serial = entry.serial;
+    stats.keyframes++;
+  }
+  stats.frames_recorded++;
+}
+
+void RewindBuffer::drop_oldest() {
+  // The frames stored against a keyframe go with it.
+  do {
+    used -= entries.front().size;
+    entries.pop_front();
+    stats.frames_dropped++;
+  } while (!entries.empty() && entries.front().keyframe_distance != 0);
+}
+
+const uint8_t* RewindBuffer::read(const Entry& entry) {
+  if (entry.offset + entry.size <= capacity()) {
+    return &ring[entry.offset];
+  }
+  const size_t first = capacity() - entry.offset;
+  memcpy(scratch.data(), &ring[entry.offset], first);
+  memcpy(scratch.data() + first, &ring[0], entry.size - first);
+  return scratch.data();
+}
+
+bool RewindBuffer::step_back(CPUState& cpu, Scheduler& scheduler) {
+  if (entries.size() < 2) {
+    return false;
+  }
+  used -= entries.back().size;
+  head = entries.back().offset;
+  entries.pop_back();
+
+  const Entry& entry = entries.back();
+  const Entry& keyframe = entries[entries.size() - 1 - entry.keyframe_distance];
+  uint8_t* memory = cpu.ram + GAME_RAM_START;
+
+  if (keyframe.serial != keyframe_serial) {
+    const uint8_t* data = read(keyframe);
+    if (!rle_decompress(data + sizeof(MachineSnapshot), keyframe.size - sizeof(MachineSnapshot),
+      keyframe_memory.data(), GAME_RAM_SIZE)) {
+      throw std::runtime_error("Error: Rewind buffer is corrupt");
+    }
+    keyframe_serial = keyframe.serial;
+  }
+
+  const uint8_t* data = read(entry);
+  MachineSnapshot machine;
+  memcpy(&machine, data, sizeof(machine));
+  if (entry.keyframe_distance == 0) {
+    memcpy(memory, keyframe_memory.data(), GAME_RAM_SIZE);
+  } else {
+    if (!rle_decompress(data + sizeof(machine), entry.size - sizeof(machine), delta.data(), GAME_RAM_SIZE)) {
+      throw std::runtime_error("Error: Rewind buffer is corrupt");
+    }
+    xor_memory(memory, keyframe_memory.data(), delta.data(), GAME_RAM_SIZE);
+  }
+
+  // The player's current input stays.
+  memcpy(machine.input_ports, cpu.input_ports, sizeof(machine.input_ports));
+  restore_machine(cpu, scheduler, machine);
+  invalidate_restored_code(cpu, GAME_RAM_START, GAME_RAM_SIZE);
+  stats.steps_back++;
+  return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "cpu.h"
+#include "save_state.h"
+#include "scheduler.h"
+
+struct RewindStats {
+  uint64_t frames_recorded = 0;
+  uint64_t keyframes = 0;
+  uint64_t frames_dropped = 0; // Recorded frames evicted to make room for newer ones.
+  uint64_t steps_back = 0;
+};
+
+// History of the machine after every frame, in a ring buffer of fixed size, to step back through frame by frame.
+//
+// Only the game RAM is recorded. Every keyframe_interval frames it is stored whole, the frames in between as the
+// XOR of their RAM with the keyframe's, which is mostly zeros. Both are run-length encoded (see rle_compress), along
+// with a MachineSnapshot. Restoring a frame decodes at most its keyframe and its own delta, and the decoded keyframe
+// is kept for the frames after it, so scrubbing back costs about as much as recording.
+//
+// When the buffer is full the oldest keyframe is dropped, together with the frames stored against it.
+struct RewindBuffer {
+  RewindStats stats;
+
+  explicit RewindBuffer(size_t capacity, uint32_t keyframe_interval = 60);
+
+  // Records the machine as it is after a frame.
+  void record(CPUState& cpu, const Scheduler& scheduler);
+
+  // Goes back one frame: drops the newest frame recorded and restores the one before it, which stays recorded.
+  // The input ports keep their current values, they follow the player rather than the history. Returns false,
+  // changing nothing, unless at least two frames are recorded.
+  bool step_back(CPUState& cpu, Scheduler& scheduler);
+
+  size_t frames() const { return entries.size(); }
+  size_t bytes_used() const { return used; }
+  size_t capacity() const { return ring.size(); }
+
+private:
+  struct Entry {
+    size_t offset;               // In the ring, the data may wrap around its end.
+    uint32_t size;
+    uint32_t keyframe_distance;  // Frames after the keyframe this one is stored against, 0 for keyframes.
+    uint64_t serial;
+  };
+
+  std::vector<uint8_t> ring;
+  size_t head = 0; // Where the next frame goes.
+  size_t used = 0;
+  std::deque<Entry> entries;
+  uint32_t keyframe_interval;
+  uint64_t next_serial = 0;
+
+  // Memory of the keyframe the newest frame is stored against.
+  std::vector<uint8_t> keyframe_memory;
+  uint64_t keyframe_serial = 0;
+
+  // Encoded frame being recorded, frame data read back, and XOR deltas.
+  std::vector<uint8_t> encoded, scratch, delta;
+
+  size_t encode(CPUState& cpu, const Scheduler& scheduler, bool keyframe);
+  void drop_oldest();
+  // Data of an entry as one contiguous block, valid until the next call.
+  const uint8_t* read(const Entry& entry);
+};
@@ -0,0 +1,131 @@
+#include "rom.h"
+
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr std::array<uint32_t, 256> CRC32_TABLE = [] {
+  std::array<uint32_t, 256> table {};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+uint32_t crc32(const uint8_t* data, size_t size) {
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++) {
+    crc = CRC32_TABLE[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// A file mapped read-only for as long as it lives.
+struct MappedFile {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+
+  explicit MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) < 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error("Error: Could not open file " + filename);
+    }
+    size = status.st_size;
+    void* memory = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Error: Could not map file " + filename);
+    }
+    data = (const uint8_t*)memory;
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data) {
+      munmap((void*)data, size);
+    }
+  }
+};
+
+void check_size(const std::string& filename, size_t size, size_t expected) {
+  if (size != expected) {
+    throw std::runtime_error("Error: " + filename + " is " + std::to_string(size) + " bytes, expected "
+      + std::to_string(expected));
+  }
+}
+
+// Warns unless `data` is the known dump of `part`, returns whether it is.
+bool verify_part(const RomPart& part, const uint8_t* data, const std::string& source) {
+  const uint32_t crc = crc32(data, part.size);
+  if (crc == part.crc32) {
+    return true;
+  }
+  std::cerr << "Warning: " << source << " is not the known dump of " << part.filename << " (CRC-32 "
+    << std::hex << std::setw(8) << std::setfill('0') << crc << " rather than " << std::setw(8) << part.crc32
+    << std::dec << std::setfill(' ') << "), loading it anyway" << std::endl;
+  return false;
+}
+
+std::shared_ptr<const MemoryImage> load_rom(const std::string& directory, RomLoadStats& stats) {
+  const auto start = std::chrono::steady_clock::now();
+  stats = {};
+
+  // Every part as mapped, verified before any is placed.
+  std::vector<const uint8_t*> parts;
+  std::vector<std::unique_ptr<MappedFile>> files;
+
+  const std::string image_filename = directory + "/" + ROM_IMAGE_FILENAME;
+  stats.from_image = access(image_filename.c_str(), F_OK) == 0;
+  if (stats.from_image) {
+    files.push_back(std::make_unique<MappedFile>(image_filename));
+    check_size(image_filename, files.back()->size, ROM_SIZE);
+    for (const RomPart& part : SPACE_INVADERS_ROM) {
+      parts.push_back(files.back()->data + part.address);
+    }
+  } else {
+    for (const RomPart& part : SPACE_INVADERS_ROM) {
+      const std::string filename = directory + "/" + part.filename;
+      files.push_back(std::make_unique<MappedFile>(filename));
+      check_size(filename, files.back()->size, part.size);
+      parts.push_back(files.back()->data);
+    }
+  }
+
+  for (size_t i = 0; i < parts.size(); i++) {
+    const RomPart& part = SPACE_INVADERS_ROM[i];
+    const std::string source = stats.from_image ? image_filename : directory + "/" + part.filename;
+    stats.unknown_parts += !verify_part(part, parts[i], source);
+  }
+
+  // Straight from the mappings to the shared image, the parts are smaller than a host page to map them in place.
+  auto image = MemoryImage::create(GUEST_MEMORY_SIZE, [&](uint8_t* memory) {
+    for (size_t i = 0; i < parts.size(); i++) {
+      memcpy(memory + SPACE_INVADERS_ROM[i].address, parts[i], SPACE_INVADERS_ROM[i].size);
+    }
+  });
+  stats.time = std::chrono::steady_clock::now() - start;
+  return image;
+}
+
+void protect_rom(CPUState& cpu) {
+  for (size_t page = 0; page < ROM_SIZE >> 8; page++) {
+    cpu.code_pages[page] |= CODE_PAGE_READ_ONLY;
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "cpu.h"
+#include "guest_memory.h"
+
+// A ROM chip of the set: where it goes in guest memory and the CRC-32 of the known good dump.
+struct RomPart {
+  const char* filename;
+  uint16_t address;
+  uint16_t size;
+  uint32_t crc32;
+};
+
+// Space Invaders, four 2 KB chips filling 0x0000-0x1FFF.
+constexpr RomPart SPACE_INVADERS_ROM[] = {
+  { "invaders.h", 0x0000, 0x0800, 0x734F5AD8 },
+  { "invaders.g", 0x0800, 0x0800, 0x6BFACA4A },
+  { "invaders.f", 0x1000, 0x0800, 0x0CCEAD96 },
+  { "invaders.e", 0x1800, 0x0800, 0x14E538B0 },
+};
+constexpr size_t ROM_SIZE = 0x2000;
+
+// The parts concatenated in address order, taken instead of the separate files if present.
+constexpr auto ROM_IMAGE_FILENAME = "invaders";
+
+struct RomLoadStats {
+  bool from_image = false;        // Read from ROM_IMAGE_FILENAME rather than the separate parts.
+  uint32_t unknown_parts = 0;     // Parts that aren't the known dump (patched or bad), loaded anyway.
+  std::chrono::steady_clock::duration time {}; // Mapping, verifying and placing the ROM.
+};
+
+// The guest memory image at reset: the ROM set from `directory` at its addresses, zeros above it. Files are mapped
+// rather than read, and a part of the wrong size is an error. A part whose checksum isn't the known one only gets
+// a warning and is counted in stats.unknown_parts.
+std::shared_ptr<const MemoryImage> load_rom(const std::string& directory, RomLoadStats& stats);
+
+// Makes the ROM read-only for the guest: writes to it are discarded and counted in cpu.discarded_writes.
+void protect_rom(CPUState& cpu);
+
+// CRC-32 as in zip and MAME ROM sets.
+uint32_t crc32(const uint8_t* data, size_t size);
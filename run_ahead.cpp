@@ -0,0 +1,35 @@
+#include "run_ahead.h"
+
+#include <cstring>
+
+RunAhead::RunAhead(uint32_t frames) : frames(frames), display(0x10000), memory(GAME_RAM_SIZE) {}
+
+void RunAhead::present(CPUState& cpu, Scheduler& scheduler, bool ahead) {
+  stats.frames_shown++;
+  if (!ahead || frames == 0) {
+    memcpy(display.data() + GAME_RAM_START, cpu.ram + GAME_RAM_START, GAME_RAM_SIZE);
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  capture_machine(cpu, scheduler, machine);
+  memcpy(memory.data(), cpu.ram + GAME_RAM_START, GAME_RAM_SIZE);
+  auto now = std::chrono::steady_clock::now();
+  stats.snapshot_time += now - start;
+  start = now;
+
+  for (uint32_t frame = 0; frame < frames; frame++) {
+    run_frame(cpu, scheduler);
+  }
+  stats.frames_ahead += frames;
+  memcpy(display.data() + GAME_RAM_START, cpu.ram + GAME_RAM_START, GAME_RAM_SIZE);
+  now = std::chrono::steady_clock::now();
+  stats.ahead_time += now - start;
+  start = now;
+
+  memcpy(machine.input_ports, cpu.input_ports, sizeof(machine.input_ports));
+  restore_machine(cpu, scheduler, machine);
+  memcpy(cpu.ram + GAME_RAM_START, memory.data(), GAME_RAM_SIZE);
+  invalidate_restored_code(cpu, GAME_RAM_START, GAME_RAM_SIZE);
+  stats.snapshot_time += std::chrono::steady_clock::now() - start;
+}
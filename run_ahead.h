@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "cpu.h"
+#include "save_state.h"
+#include "scheduler.h"
+
+struct RunAheadStats {
+  uint64_t frames_shown = 0;
+  uint64_t frames_ahead = 0; // Emulated ahead and thrown away.
+  std::chrono::steady_clock::duration ahead_time {};    // Spent emulating them.
+  std::chrono::steady_clock::duration snapshot_time {}; // Spent taking and restoring snapshots.
+};
+
+// Run-ahead hides the game's own input lag: after every frame the machine is emulated `frames` frames further with
+// the current input, the last of them is shown, and the machine goes back to where it was. Each frame shown costs
+// `frames` extra frames, plus a copy of the game RAM and a MachineSnapshot each way.
+struct RunAhead {
+  uint32_t frames;
+  // The game RAM of the frame to show, at its guest addresses (64 KB).
+  std::vector<uint8_t> display;
+  RunAheadStats stats;
+
+  explicit RunAhead(uint32_t frames);
+
+  // Called once the machine has run its frame: runs ahead, keeps the game RAM reached in `display` and restores
+  // the machine, all but its input ports which keep following the player. Without `ahead` (while rewinding, say)
+  // only the current game RAM is kept.
+  void present(CPUState& cpu, Scheduler& scheduler, bool ahead = true);
+
+private:
+  MachineSnapshot machine;
+  std::vector<uint8_t> memory;
+};
@@ -0,0 +1,359 @@
+#include "save_state.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+constexpr char SAVE_STATE_MAGIC[8] = { 'I', '8', '0', '8', '0', 'S', 'S', '\0' };
+
+// Longest literal and repeat of a single control byte, see rle_compress.
+constexpr size_t RLE_MAX_LITERALS = 0x80;
+constexpr size_t RLE_MIN_RUN = 3;
+constexpr size_t RLE_MAX_RUN = 0x7F + RLE_MIN_RUN;
+
+// Registers in 8080 encoding order, independent of how CPUState lays them out.
+constexpr uint8_t saved_registers[] = {
+  B_REGISTER, C_REGISTER, D_REGISTER, E_REGISTER, H_REGISTER, L_REGISTER, A_REGISTER,
+};
+
+// Identifies the ROM a state was saved from. Four words are hashed at a time, the bytewise rom_checksum would
+// take longer than copying the rest of the state.
+uint64_t rom_hash(const uint8_t* rom) {
+  uint64_t lanes[4] = { 1, 2, 3, 4 };
+  for (size_t offset = 0; offset < STATE_RAM_START; offset += sizeof(lanes)) {
+    for (size_t lane = 0; lane < 4; lane++) {
+      uint64_t word;
+      memcpy(&word, rom + offset + lane * sizeof(word), sizeof(word));
+      lanes[lane] = (lanes[lane] ^ word) * 0x9E3779B97F4A7C15ull;
+      lanes[lane] ^= lanes[lane] >> 29;
+    }
+  }
+  return (lanes[0] ^ lanes[1] * 3) ^ (lanes[2] * 5 ^ lanes[3] * 7);
+}
+
+template <typename T>
+void put(std::vector<uint8_t>& out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out.push_back((uint8_t)(value >> (i * 8)));
+  }
+}
+
+// Reads the fields of a state in order, throwing once it runs out of bytes.
+struct StateReader {
+  const uint8_t* data;
+  size_t size;
+  size_t offset = 0;
+
+  const uint8_t* take(size_t count) {
+    if (size - offset < count) {
+      throw std::runtime_error("Error: Save state is truncated");
+    }
+    offset += count;
+    return data + offset - count;
+  }
+
+  template <typename T>
+  T get() {
+    const uint8_t* bytes = take(sizeof(T));
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      value |= (T)bytes[i] << (i * 8);
+    }
+    return value;
+  }
+};
+
+void capture_machine(CPUState& cpu, const Scheduler& scheduler, MachineSnapshot& snapshot) {
+  materialize_flags(cpu);
+  memcpy(snapshot.registers, cpu.registers, sizeof(snapshot.registers));
+  snapshot.pc = cpu.pc;
+  snapshot.sp = cpu.sp;
+  snapshot.shift_register = cpu.shift_register;
+  snapshot.shift_offset = cpu.shift_offset;
+  snapshot.zero = cpu.zero;
+  snapshot.sign = cpu.sign;
+  snapshot.parity = cpu.parity;
+  snapshot.carry = cpu.carry;
+  snapshot.aux_carry = cpu.aux_carry;
+  snapshot.enable_interrupt = cpu.enable_interrupt;
+  snapshot.halt = cpu.halt;
+  memcpy(snapshot.input_ports, cpu.input_ports, sizeof(snapshot.input_ports));
+
+  snapshot.cycles = scheduler.cycles;
+  snapshot.idle_cycles = scheduler.idle_cycles;
+  snapshot.frames = scheduler.frames;
+  if (scheduler.events.size() > snapshot.events.size()) {
+    throw std::runtime_error("Error: Too many scheduler events to snapshot");
+  }
+  snapshot.event_count = 0;
+  for (auto events = scheduler.events; !events.empty(); events.pop()) {
+    snapshot.events[snapshot.event_count++] = events.top();
+  }
+}
+
+void restore_machine(CPUState& cpu, Scheduler& scheduler, const MachineSnapshot& snapshot) {
+  memcpy(cpu.registers, snapshot.registers, sizeof(cpu.registers));
+  cpu.pc = snapshot.pc;
+  cpu.sp = snapshot.sp;
+  cpu.shift_register = snapshot.shift_register;
+  cpu.shift_offset = snapshot.shift_offset;
+  cpu.zero = snapshot.zero;
+  cpu.sign = snapshot.sign;
+  cpu.parity = snapshot.parity;
+  cpu.carry = snapshot.carry;
+  cpu.aux_carry = snapshot.aux_carry;
+  cpu.pending_flags = 0;
+  cpu.enable_interrupt = snapshot.enable_interrupt;
+  cpu.halt = snapshot.halt;
+  memcpy(cpu.input_ports, snapshot.input_ports, sizeof(cpu.input_ports));
+  cpu.spin_signature = {};
+
+  scheduler.cycles = snapshot.cycles;
+  scheduler.idle_cycles = snapshot.idle_cycles;
+  scheduler.frames = snapshot.frames;
+  scheduler.events = {};
+  for (size_t i = 0; i < snapshot.event_count; i++) {
+    scheduler.events.push(snapshot.events[i]);
+  }
+}
+
+void invalidate_restored_code(CPUState& cpu, size_t start, size_t size) {
+  for (size_t page = start >> 8; page < (start + size + 0xFF) >> 8; page++) {
+    if (cpu.code_pages[page]) {
+      cpu.code_pages[page] &= ~CODE_PAGE_CLEAN;
+      invalidate_code(cpu, page << 8);
+    }
+  }
+}
+
+void save_state(CPUState& cpu, const Scheduler& scheduler, bool compress, std::vector<uint8_t>& out) {
+  MachineSnapshot machine;
+  capture_machine(cpu, scheduler, machine);
+
+  out.insert(out.end(), std::begin(SAVE_STATE_MAGIC), std::end(SAVE_STATE_MAGIC));
+  put<uint16_t>(out, SAVE_STATE_VERSION);
+  put<uint16_t>(out, compress ? SAVE_STATE_COMPRESSED : 0);
+  put<uint64_t>(out, rom_hash(cpu.ram));
+
+  for (uint8_t reg : saved_registers) {
+    put<uint8_t>(out, machine.registers[register_index(reg)]);
+  }
+  put<uint16_t>(out, machine.pc);
+  put<uint16_t>(out, machine.sp);
+  put<uint16_t>(out, machine.shift_register);
+  put<uint8_t>(out, machine.shift_offset);
+  put<uint8_t>(out, machine.sign << 7 | machine.zero << 6 | machine.aux_carry << 4 | machine.parity << 2 | 1 << 1
+    | machine.carry);
+  put<uint8_t>(out, machine.enable_interrupt);
+  put<uint8_t>(out, machine.halt);
+  for (uint8_t port : machine.input_ports) {
+    put<uint8_t>(out, port);
+  }
+
+  put<uint64_t>(out, machine.cycles);
+  put<uint64_t>(out, machine.idle_cycles);
+  put<uint64_t>(out, machine.frames);
+  put<uint8_t>(out, machine.event_count);
+  for (size_t i = 0; i < machine.event_count; i++) {
+    put<uint64_t>(out, machine.events[i].cycle);
+    put<uint8_t>(out, machine.events[i].type);
+  }
+
+  if (compress) {
+    put<uint32_t>(out, 0);
+    const size_t offset = out.size();
+    out.resize(offset + rle_max_size(STATE_RAM_SIZE));
+    const uint32_t packed = rle_compress(cpu.ram + STATE_RAM_START, STATE_RAM_SIZE, &out[offset]);
+    out.resize(offset + packed);
+    for (size_t i = 0; i < sizeof(packed); i++) {
+      out[offset - sizeof(packed) + i] = (uint8_t)(packed >> (i * 8));
+    }
+  } else {
+    const size_t offset = out.size();
+    out.resize(offset + STATE_RAM_SIZE);
+    memcpy(&out[offset], cpu.ram + STATE_RAM_START, STATE_RAM_SIZE);
+  }
+}
+
+void load_state(CPUState& cpu, Scheduler& scheduler, const uint8_t* data, size_t size) {
+  StateReader in { data, size };
+  if (memcmp(in.take(sizeof(SAVE_STATE_MAGIC)), SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC)) != 0) {
+    throw std::runtime_error("Error: Not a save state");
+  }
+  const uint16_t version = in.get<uint16_t>();
+  if (version != SAVE_STATE_VERSION) {
+    throw std::runtime_error("Error: Unsupported save state version " + std::to_string(version));
+  }
+  const uint16_t flags = in.get<uint16_t>();
+  if (in.get<uint64_t>() != rom_hash(cpu.ram)) {
+    throw std::runtime_error("Error: Save state is from another ROM");
+  }
+
+  // Everything is read before the machine is touched.
+  MachineSnapshot machine;
+  for (uint8_t reg : saved_registers) {
+    machine.registers[register_index(reg)] = in.get<uint8_t>();
+  }
+  machine.registers[register_index(0b110)] = 0; // The slot of M, not a register.
+  machine.pc = in.get<uint16_t>();
+  machine.sp = in.get<uint16_t>();
+  machine.shift_register = in.get<uint16_t>();
+  machine.shift_offset = in.get<uint8_t>();
+  const uint8_t psw = in.get<uint8_t>();
+  machine.sign = psw & 0x80;
+  machine.zero = psw & 0x40;
+  machine.aux_carry = psw & 0x10;
+  machine.parity = psw & 0x04;
+  machine.carry = psw & 0x01;
+  machine.enable_interrupt = in.get<uint8_t>();
+  machine.halt = in.get<uint8_t>();
+  for (uint8_t& port : machine.input_ports) {
+    port = in.get<uint8_t>();
+  }
+
+  machine.cycles = in.get<uint64_t>();
+  machine.idle_cycles = in.get<uint64_t>();
+  machine.frames = in.get<uint64_t>();
+  machine.event_count = in.get<uint8_t>();
+  if (machine.event_count == 0 || machine.event_count > machine.events.size()) {
+    throw std::runtime_error("Error: Save state has an invalid number of events");
+  }
+  for (size_t i = 0; i < machine.event_count; i++) {
+    machine.events[i].cycle = in.get<uint64_t>();
+    const uint8_t type = in.get<uint8_t>();
+    if (type > EVENT_VBLANK) {
+      throw std::runtime_error("Error: Save state has an unknown event");
+    }
+    machine.events[i].type = (EventType)type;
+  }
+
+  if (flags & SAVE_STATE_COMPRESSED) {
+    const uint32_t packed = in.get<uint32_t>();
+    if (!rle_decompress(in.take(packed), packed, cpu.ram + STATE_RAM_START, STATE_RAM_SIZE)) {
+      throw std::runtime_error("Error: Save state memory is corrupt");
+    }
+  } else {
+    memcpy(cpu.ram + STATE_RAM_START, in.take(STATE_RAM_SIZE), STATE_RAM_SIZE);
+  }
+  restore_machine(cpu, scheduler, machine);
+  invalidate_restored_code(cpu, STATE_RAM_START, STATE_RAM_SIZE);
+}
+
+void write_state_file(const std::string& filename, const std::vector<uint8_t>& state) {
+  std::ofstream state_out(filename, std::ios::binary);
+  if (!state_out.is_open()) {
+    throw std::runtime_error("Error: Could not open file " + filename);
+  }
+  state_out.write((const char*)state.data(), state.size());
+}
+
+std::vector<uint8_t> read_state_file(const std::string& filename) {
+  std::ifstream state_in(filename, std::ios::binary);
+  if (!state_in.is_open()) {
+    throw std::runtime_error("Error: Could not open file " + filename);
+  }
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(state_in), std::istreambuf_iterator<char>());
+}
+
+// First position from `from` on where RLE_MIN_RUN equal bytes start, or `size` if there is none. Eight positions
+// are checked at a time: a byte of (x ^ y) | (y ^ z) is zero where three consecutive bytes are equal.
+size_t find_run(const uint8_t* data, size_t from, size_t size) {
+  static_assert(RLE_MIN_RUN == 3);
+  size_t i = from;
+  for (; i + sizeof(uint64_t) + 2 <= size; i += sizeof(uint64_t)) {
+    uint64_t x, y, z;
+    memcpy(&x, data + i, sizeof(x));
+    memcpy(&y, data + i + 1, sizeof(y));
+    memcpy(&z, data + i + 2, sizeof(z));
+    const uint64_t differences = (x ^ y) | (y ^ z);
+    const uint64_t zero_bytes = (differences - 0x0101010101010101ull) & ~differences & 0x8080808080808080ull;
+    if (zero_bytes) {
+      // Exact for the lowest zero byte, which is the first position (little-endian).
+      return i + std::countr_zero(zero_bytes) / 8;
+    }
+  }
+  for (; i + 2 < size; i++) {
+    if (data[i] == data[i + 1] && data[i] == data[i + 2]) {
+      return i;
+    }
+  }
+  return size;
+}
+
+size_t rle_compress(const uint8_t* data, size_t size, uint8_t* out) {
+  const uint8_t* const out_start = out;
+  size_t literal_start = 0; // Bytes from here up to `i` are yet to be written as literals.
+
+  const auto flush_literals = [&](size_t end) {
+    while (literal_start < end) {
+      const size_t count = std::min(end - literal_start, RLE_MAX_LITERALS);
+      *out++ = count - 1;
+      memcpy(out, data + literal_start, count);
+      out += count;
+      literal_start += count;
+    }
+  };
+
+  for (size_t i = 0; i < size;) {
+    const uint8_t value = data[i];
+    const size_t limit = std::min(size - i, RLE_MAX_RUN);
+    size_t run = 1;
+
+    // Long runs (mostly zeros) are compared a word at a time.
+    uint64_t word;
+    const uint64_t repeated = value * 0x0101010101010101ull;
+    while (run + sizeof(word) <= limit && (memcpy(&word, data + i + run, sizeof(word)), word == repeated)) {
+      run += sizeof(word);
+    }
+    while (run < limit && data[i + run] == value) {
+      run++;
+    }
+
+    if (run >= RLE_MIN_RUN) {
+      flush_literals(i);
+      *out++ = 0x80 + run - RLE_MIN_RUN;
+      *out++ = value;
+      i += run;
+      literal_start = i;
+    } else {
+      i = find_run(data, i + 1, size);
+    }
+  }
+  flush_literals(size);
+  return out - out_start;
+}
+
+bool rle_decompress(const uint8_t* data, size_t data_size, uint8_t* out, size_t size) {
+  // Checked up front, so that `out` is only written if the whole input is valid.
+  size_t unpacked = 0;
+  for (size_t i = 0; i < data_size;) {
+    const uint8_t control = data[i];
+    const size_t length = control < 0x80 ? control + 1 : control - 0x80 + RLE_MIN_RUN;
+    i += control < 0x80 ? 1 + length : 2;
+    if (i > data_size) {
+      return false;
+    }
+    unpacked += length;
+  }
+  if (unpacked != size) {
+    return false;
+  }
+
+  for (size_t i = 0; i < data_size;) {
+    const uint8_t control = data[i++];
+    if (control < 0x80) {
+      const size_t count = control + 1;
+      memcpy(out, data + i, count);
+      out += count;
+      i += count;
+    } else {
+      const size_t count = control - 0x80 + RLE_MIN_RUN;
+      memset(out, data[i++], count);
+      out += count;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+
+// Save states: everything needed to resume a machine, in a compact versioned binary format.
+//
+// A state holds the registers, flags, shift register, input ports, interrupt state, the scheduler's clock and
+// pending events, and the memory from STATE_RAM_START up. The ROM below it is identified by a hash rather
+// than stored, a state only loads over the ROM it was saved from. Every field is little-endian:
+//
+//   header    magic "I8080SS\0", version (u16), flags (u16), ROM hash (u64)
+//   cpu       B C D E H L A (u8 each), PC SP shift register (u16 each), shift offset, flags as in PSW,
+//             interrupts enabled, halted, input ports 0-2 (u8 each)
+//   scheduler cycles, idle cycles, frames (u64 each), event count (u8), then cycle (u64) and type (u8) per event
+//   memory    STATE_RAM_SIZE bytes, or the payload size (u32) and the bytes packed by rle_compress if
+//             SAVE_STATE_COMPRESSED is set
+//
+// Versions are only ever added, load_state rejects any it doesn't know.
+constexpr uint16_t SAVE_STATE_VERSION = 1;
+constexpr uint16_t SAVE_STATE_COMPRESSED = 1 << 0;
+
+constexpr size_t STATE_RAM_START = 0x2000;
+constexpr size_t STATE_RAM_SIZE = 0x10000 - STATE_RAM_START;
+
+// Work and video RAM, the only memory the game writes (nothing is used above it). Snapshots kept in memory, see
+// rewind.h and run_ahead.h, only copy this part.
+constexpr size_t GAME_RAM_START = 0x2000;
+constexpr size_t GAME_RAM_SIZE = 0x2000;
+
+// Everything in a save state but the memory, as a plain struct for snapshots kept in memory.
+struct MachineSnapshot {
+  uint8_t registers[8];
+  uint16_t pc, sp, shift_register;
+  uint8_t shift_offset;
+  bool zero, sign, parity, carry, aux_carry;
+  bool enable_interrupt, halt;
+  uint8_t input_ports[3];
+
+  uint64_t cycles, idle_cycles, frames;
+  std::array<Event, 4> events; // Pending scheduler events, the first event_count in firing order.
+  uint8_t event_count;
+};
+
+// Flags are materialized first so that snapshots don't depend on LAZY_FLAGS.
+void capture_machine(CPUState& cpu, const Scheduler& scheduler, MachineSnapshot& snapshot);
+// Leaves the memory, the attached engines and the statistics as they are.
+void restore_machine(CPUState& cpu, Scheduler& scheduler, const MachineSnapshot& snapshot);
+
+// Notifies the code caches and the write tracking that memory in [start, start + size) was overwritten, page by
+// page. Memory written other than through CPUState::write_memory must be reported this way.
+void invalidate_restored_code(CPUState& cpu, size_t start, size_t size);
+
+// Appends the state of the machine to `out`, with the memory run-length encoded if `compress` is set.
+void save_state(CPUState& cpu, const Scheduler& scheduler, bool compress, std::vector<uint8_t>& out);
+
+// Restores a state written by save_state. Translated code overwritten by the restored memory is invalidated.
+// Throws if the state is malformed, of an unknown version or saved from another ROM, leaving the machine as it was.
+void load_state(CPUState& cpu, Scheduler& scheduler, const uint8_t* data, size_t size);
+
+void write_state_file(const std::string& filename, const std::vector<uint8_t>& state);
+std::vector<uint8_t> read_state_file(const std::string& filename);
+
+// Byte-oriented run-length codec, fast enough to run every frame. A control byte below 0x80 is followed by that
+// many plus one literal bytes, from 0x80 up it repeats the next byte (control - 0x80 + 3) times.
+//
+// Largest output of rle_compress for `size` input bytes.
+constexpr size_t rle_max_size(size_t size) {
+  return size + (size + 127) / 128;
+}
+
+// Packs `size` bytes into `out`, which must hold rle_max_size(size) bytes. Returns the packed size.
+size_t rle_compress(const uint8_t* data, size_t size, uint8_t* out);
+
+// Unpacks exactly `size` bytes into `out`. Returns false if `data` doesn't unpack to exactly that many.
+bool rle_decompress(const uint8_t* data, size_t data_size, uint8_t* out, size_t size);
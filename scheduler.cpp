@@ -0,0 +1,73 @@
+#include "scheduler.h"
+
+#include <thread>
+
+#include "aot.h"
+#include "blocks.h"
+#include "jit.h"
+#include "profiler.h"
+#include "tiers.h"
+
+Scheduler::Scheduler() {
+  schedule(MID_SCREEN_CYCLE, EVENT_MID_SCREEN);
+  schedule(VBLANK_CYCLE, EVENT_VBLANK);
+}
+
+uint32_t run_cpu(CPUState& cpu, uint32_t budget) {
+  if (cpu.profiler) {
+    return run_profiled(cpu, budget);
+  } else if (cpu.tiers) {
+    return run_tiered(cpu, budget);
+  } else if (cpu.aot) {
+    return run_aot(cpu, budget);
+  } else if (cpu.jit) {
+    return run_jit(cpu, budget);
+  } else if (cpu.block_cache) {
+    return run_blocks(cpu, budget);
+  }
+  return run_cycles(cpu, budget);
+}
+
+uint32_t run_frame(CPUState& cpu, Scheduler& scheduler) {
+  uint64_t start = scheduler.cycles;
+
+  while (true) {
+    Event event = scheduler.events.top();
+    if (scheduler.cycles < event.cycle) {
+      uint32_t budget = event.cycle - scheduler.cycles;
+      if (cpu.halt) {
+        // Nothing can happen before the next interrupt.
+        scheduler.idle_cycles += budget;
+        scheduler.cycles += budget;
+      } else {
+        scheduler.cycles += run_cpu(cpu, budget);
+      }
+      continue;
+    }
+
+    scheduler.events.pop();
+    scheduler.schedule(event.cycle + CYCLES_PER_FRAME, event.type);
+
+    switch (event.type) {
+      case EVENT_MID_SCREEN:
+        interrupt_cpu(cpu, 1);
+        break;
+      case EVENT_VBLANK:
+        interrupt_cpu(cpu, 2);
+        scheduler.frames++;
+        return scheduler.cycles - start;
+    }
+  }
+}
+
+void FramePacer::wait() {
+  constexpr auto frame_time = std::chrono::nanoseconds(1000000000 / FRAMES_PER_SECOND);
+
+  next_frame_time += frame_time;
+  auto now = std::chrono::steady_clock::now();
+  if (next_frame_time > now) {
+    std::this_thread::sleep_until(next_frame_time);
+  } else {
+    next_frame_time = now;
+  }
+}
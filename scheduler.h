@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <queue>
+#include <vector>
+
+#include "cpu.h"
+
+// Space Invaders timing: a 2 MHz 8080 and a 60 Hz display of 256 lines, 224 of which are visible.
+constexpr uint32_t CPU_CLOCK_HZ = 2000000;
+constexpr uint32_t FRAMES_PER_SECOND = 60;
+constexpr uint32_t CYCLES_PER_FRAME = CPU_CLOCK_HZ / FRAMES_PER_SECOND;
+constexpr uint32_t LINES_PER_FRAME = 256;
+
+// RST 1 is raised when the beam reaches the middle of the screen, RST 2 when it enters the vertical blank.
+constexpr uint32_t MID_SCREEN_CYCLE = CYCLES_PER_FRAME * 96 / LINES_PER_FRAME;
+constexpr uint32_t VBLANK_CYCLE = CYCLES_PER_FRAME * 224 / LINES_PER_FRAME;
+
+enum EventType : uint8_t {
+  EVENT_MID_SCREEN,
+  EVENT_VBLANK,
+};
+
+struct Event {
+  uint64_t cycle;
+  EventType type;
+
+  bool operator>(const Event& other) const {
+    return cycle != other.cycle ? cycle > other.cycle : type > other.type;
+  }
+};
+
+// Timed events keyed on emulated cycles, so that interrupts land at the same point of the program however fast
+// the host is.
+struct Scheduler {
+  // Emulated cycles since reset, including the ones skipped while the CPU was waiting for an interrupt.
+  uint64_t cycles = 0;
+  uint64_t idle_cycles = 0;
+  uint64_t frames = 0;
+
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+
+  Scheduler();
+
+  void schedule(uint64_t cycle, EventType type) {
+    events.push({ cycle, type });
+  }
+};
+
+// Runs the CPU on whichever execution engine is attached to it (see run_cycles).
+uint32_t run_cpu(CPUState& cpu, uint32_t budget);
+
+// Runs the CPU up to the end of the frame (the vertical blank interrupt), firing the events as they come due.
+// While the CPU waits for an interrupt the cycles up to the next event are skipped. Returns the cycles taken.
+uint32_t run_frame(CPUState& cpu, Scheduler& scheduler);
+
+// Wall-clock pacing, kept apart from the scheduler: only whole frames are throttled to FRAMES_PER_SECOND.
+struct FramePacer {
+  std::chrono::steady_clock::time_point next_frame_time = std::chrono::steady_clock::now();
+
+  // Sleeps until the next frame is due. Falls back in step instead of catching up if the host is too slow.
+  void wait();
+};
@@ -0,0 +1,110 @@
+#include "tiers.h"
+
+#include <chrono>
+
+TieredExecution::TieredExecution(TierThresholds thresholds) : thresholds(thresholds) {
+  if (thresholds.native && jit_supported()) {
+    jit = std::make_unique<Jit>();
+  }
+}
+
+double TieredExecution::cycle_share(Tier tier) const {
+  uint64_t total = stats.cycles[TIER_INTERPRETER] + stats.cycles[TIER_BLOCKS] + stats.cycles[TIER_NATIVE];
+  return total ? (double)stats.cycles[tier] / total : 0.0;
+}
+
+double TieredExecution::time_share(Tier tier) const {
+  uint64_t total = stats.nanoseconds[TIER_INTERPRETER] + stats.nanoseconds[TIER_BLOCKS] + stats.nanoseconds[TIER_NATIVE];
+  return total ? (double)stats.nanoseconds[tier] / total : 0.0;
+}
+
+void attach_tiers(CPUState& cpu, TieredExecution& tiers) {
+  attach_block_cache(cpu, tiers.block_cache);
+  if (tiers.jit) {
+    attach_jit(cpu, *tiers.jit);
+  }
+  cpu.tiers = &tiers;
+}
+
+// Moves the block at `pc` to `tier`, its executions are counted from zero again.
+static void set_tier(TieredExecution& tiers, uint16_t pc, Tier tier) {
+  if (tier > tiers.tiers[pc]) {
+    tiers.stats.promotions[tier]++;
+  } else {
+    tiers.stats.demotions++;
+  }
+  tiers.tiers[pc] = tier;
+  tiers.counts[pc] = 0;
+}
+
+// Runs the block at cpu.pc in its tier, promoting it first if it is hot enough.
+static uint32_t run_tier(CPUState& cpu, TieredExecution& tiers, Tier& tier) {
+  uint16_t pc = cpu.pc;
+  tier = tiers.tiers[pc];
+
+  // Promoted code that has been overwritten since is gone from its cache.
+  if (tier == TIER_NATIVE && !tiers.jit->entries[pc]) [[unlikely]] {
+    tier = tiers.block_cache.blocks[pc] ? TIER_BLOCKS : TIER_INTERPRETER;
+    set_tier(tiers, pc, tier);
+  } else if (tier == TIER_BLOCKS && !tiers.block_cache.blocks[pc]) [[unlikely]] {
+    tier = TIER_INTERPRETER;
+    set_tier(tiers, pc, tier);
+  }
+
+  if (tier == TIER_INTERPRETER && ++tiers.counts[pc] >= tiers.thresholds.blocks) {
+    tiers.block_cache.compile(cpu, pc);
+    tier = TIER_BLOCKS;
+    set_tier(tiers, pc, tier);
+  } else if (tier == TIER_BLOCKS && tiers.jit && ++tiers.counts[pc] >= tiers.thresholds.native) {
+    if (tiers.jit->translate(cpu, pc)) {
+      tier = TIER_NATIVE;
+      set_tier(tiers, pc, tier);
+    } else {
+      tiers.counts[pc] = 0;
+    }
+  }
+
+  switch (tier) {
+    case TIER_NATIVE:
+      return run_jit_code(cpu, tiers.jit->entries[pc]);
+    case TIER_BLOCKS:
+      return run_block(cpu, *tiers.block_cache.blocks[pc]);
+    default: {
+      // Cold code runs through the interpreter up to the next branch.
+      uint32_t cycles = 0;
+      for (int count = 0; count < MAX_BLOCK_LENGTH; count++) {
+        uint8_t opcode = cpu.ram[cpu.pc];
+        cycles += cycle_cpu(cpu);
+        if (is_branch(opcode)) {
+          break;
+        }
+      }
+      return cycles;
+    }
+  }
+}
+
+uint32_t run_tiered(CPUState& cpu, uint32_t budget) {
+  TieredExecution& tiers = *cpu.tiers;
+  uint32_t cycles = 0;
+
+  while (cycles < budget && !cpu.halt) {
+    Tier tier;
+    uint32_t block_cycles;
+    if (++tiers.dispatches % TIER_SAMPLE_INTERVAL == 0) [[unlikely]] {
+      auto start = std::chrono::steady_clock::now();
+      block_cycles = run_tier(cpu, tiers, tier);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      tiers.stats.nanoseconds[tier] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() * TIER_SAMPLE_INTERVAL;
+    } else {
+      block_cycles = run_tier(cpu, tiers, tier);
+    }
+
+    tiers.stats.executions[tier]++;
+    tiers.stats.cycles[tier] += block_cycles;
+    cycles += block_cycles;
+  }
+
+  return cycles;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <memory>
+
+#include "cpu.h"
+#include "blocks.h"
+#include "jit.h"
+
+enum Tier : uint8_t {
+  TIER_INTERPRETER, // cycle_cpu, one instruction at a time.
+  TIER_BLOCKS,      // Predecoded blocks from the block cache.
+  TIER_NATIVE,      // Native code from the JIT.
+};
+
+constexpr auto TIER_COUNT = 3;
+constexpr const char* tier_names[TIER_COUNT] = { "interpreter", "blocks", "native" };
+
+// One in this many block executions is timed to estimate the host time spent in each tier.
+constexpr auto TIER_SAMPLE_INTERVAL = 64;
+
+struct TierThresholds {
+  // Interpreted executions of a block start address before it is predecoded.
+  uint32_t blocks = 8;
+  // Executions of a predecoded block before it is translated to native code, 0 to stay predecoded.
+  uint32_t native = 256;
+};
+
+struct TierStats {
+  // Block executions, guest cycles and estimated host time spent in each tier.
+  uint64_t executions[TIER_COUNT] = {};
+  uint64_t cycles[TIER_COUNT] = {};
+  uint64_t nanoseconds[TIER_COUNT] = {};
+
+  // Blocks promoted to each tier, and blocks sent back to a lower tier because their code was overwritten.
+  uint64_t promotions[TIER_COUNT] = {};
+  uint64_t demotions = 0;
+};
+
+// Runs every block start address in the cheapest tier first and promotes it as it gets hot.
+//
+// Code starts out in the interpreter. A start address executed thresholds.blocks times gets predecoded into the
+// block cache, and a predecoded block executed thresholds.native times more gets translated by the JIT. Writes
+// to promoted code invalidate it in the caches, it is then demoted and has to get hot again.
+struct TieredExecution {
+  TierThresholds thresholds;
+  BlockCache block_cache;
+  std::unique_ptr<Jit> jit; // Only created if native code is enabled and supported.
+
+  // Current tier and executions in that tier of each block start address.
+  std::array<Tier, 0x10000> tiers {};
+  std::array<uint32_t, 0x10000> counts {};
+
+  TierStats stats;
+  uint32_t dispatches = 0;
+
+  explicit TieredExecution(TierThresholds thresholds = {});
+
+  Tier tier_of(uint16_t pc) const {
+    return tiers[pc];
+  }
+
+  // Fraction of the guest cycles and of the (estimated) host time spent in the tier.
+  double cycle_share(Tier tier) const;
+  double time_share(Tier tier) const;
+};
+
+// Attaches the tiers and their code caches to the CPU.
+void attach_tiers(CPUState& cpu, TieredExecution& tiers);
+
+// Same as run_cycles, but runs every block in its current tier, promoting and demoting blocks on the way.
+uint32_t run_tiered(CPUState& cpu, uint32_t budget);
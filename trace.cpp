@@ -0,0 +1,119 @@
+#include "trace.h"
+
+#ifdef TRACING
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+std::atomic<bool> tracing_enabled = false;
+
+struct TraceEvent {
+  const char* name;
+  uint64_t start;
+  uint64_t end;
+};
+
+// Events of a single thread, only that thread writes to it. The events are allocated by the first one recorded, so
+// naming a thread costs nothing while tracing is off.
+struct TraceBuffer {
+  std::unique_ptr<TraceEvent[]> events;
+  std::atomic<size_t> size = 0;
+  uint64_t dropped = 0;
+  uint32_t thread_id;
+  std::string thread_name;
+};
+
+// Every thread's buffer, the lock is only taken the first time a thread records an event.
+static std::mutex trace_buffers_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+static thread_local TraceBuffer* thread_buffer = nullptr;
+
+// Reference points to convert the clock to microseconds, taken when tracing starts and stops.
+static uint64_t trace_start_clock;
+static std::chrono::steady_clock::time_point trace_start_time;
+
+static TraceBuffer& get_thread_buffer() {
+  if (!thread_buffer) {
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    auto buffer = std::make_unique<TraceBuffer>();
+    buffer->thread_id = trace_buffers.size() + 1;
+    buffer->thread_name = "thread " + std::to_string(buffer->thread_id);
+    thread_buffer = buffer.get();
+    trace_buffers.push_back(std::move(buffer));
+  }
+  return *thread_buffer;
+}
+
+void record_trace_event(const char* name, uint64_t start, uint64_t end) {
+  TraceBuffer& buffer = get_thread_buffer();
+  if (!buffer.events) [[unlikely]] {
+    buffer.events = std::make_unique<TraceEvent[]>(TRACE_BUFFER_EVENTS);
+  }
+  size_t size = buffer.size.load(std::memory_order_relaxed);
+  if (size == TRACE_BUFFER_EVENTS) {
+    buffer.dropped++;
+    return;
+  }
+  buffer.events[size] = { name, start, end };
+  buffer.size.store(size + 1, std::memory_order_release);
+}
+
+void set_trace_thread_name(const char* name) {
+  get_thread_buffer().thread_name = name;
+}
+
+void start_tracing() {
+  trace_start_time = std::chrono::steady_clock::now();
+  trace_start_clock = read_trace_clock();
+  tracing_enabled = true;
+}
+
+void write_trace(const std::string& filename) {
+  tracing_enabled = false;
+  const uint64_t end_clock = read_trace_clock();
+  const double elapsed_us =
+    std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start_time).count();
+  const double clock_per_us = elapsed_us > 0 ? (end_clock - trace_start_clock) / elapsed_us : 1;
+  const auto to_us = [&](uint64_t clock) { return (double)(clock - trace_start_clock) / clock_per_us; };
+
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    throw std::runtime_error("Error: Could not open file " + filename);
+  }
+
+  std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  for (const auto& buffer : trace_buffers) {
+    out << (first ? "\n" : ",\n")
+      << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread_id
+      << ", \"args\": {\"name\": \"" << buffer->thread_name << "\"}}";
+    first = false;
+
+    const size_t size = buffer->size.load(std::memory_order_acquire);
+    for (size_t i = 0; i < size; i++) {
+      const TraceEvent& event = buffer->events[i];
+      out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread_id
+        << ", \"ts\": " << to_us(event.start) << ", \"dur\": " << to_us(event.end) - to_us(event.start) << "}";
+    }
+    if (buffer->dropped) {
+      out << ",\n{\"name\": \"dropped " << buffer->dropped << " events\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1"
+        << ", \"tid\": " << buffer->thread_id << ", \"ts\": " << to_us(end_clock) << "}";
+    }
+  }
+  out << "\n]}" << std::endl;
+}
+
+#else
+
+void start_tracing() {}
+
+void write_trace(const std::string&) {}
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Host-side trace instrumentation, written as a Chrome trace-event file (chrome://tracing, Perfetto).
+//
+// TRACE_SCOPE("name") times the rest of the enclosing scope with the CPU timestamp counter and appends it to a
+// buffer owned by the calling thread, so recording never takes a lock. Without -DTRACING the macros expand to
+// nothing and no instrumentation is compiled in.
+
+#ifdef TRACING
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+constexpr bool TRACING_COMPILED = true;
+
+// Events a thread can record, later ones are dropped.
+constexpr size_t TRACE_BUFFER_EVENTS = 1 << 18;
+
+extern std::atomic<bool> tracing_enabled;
+
+inline uint64_t read_trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Appends a completed span to the calling thread's buffer.
+void record_trace_event(const char* name, uint64_t start, uint64_t end);
+
+// Names the calling thread in the trace.
+void set_trace_thread_name(const char* name);
+
+struct TraceScope {
+  const char* name;
+  uint64_t start;
+
+  explicit TraceScope(const char* name)
+    : name(name), start(tracing_enabled.load(std::memory_order_relaxed) ? read_trace_clock() : 0) {}
+
+  ~TraceScope() {
+    if (start) {
+      record_trace_event(name, start, read_trace_clock());
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) set_trace_thread_name(name)
+
+#else
+
+constexpr bool TRACING_COMPILED = false;
+
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+
+#endif
+
+// Starts recording, a no-op unless built with TRACING.
+void start_tracing();
+
+// Stops recording and writes every thread's events, once the instrumented threads are done.
+void write_trace(const std::string& filename);